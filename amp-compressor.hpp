@@ -0,0 +1,231 @@
+#ifndef AMP_COMPRESSOR_HPP
+#define AMP_COMPRESSOR_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "amp-kernels.hpp"
+#include "amp-table.hpp"
+
+/**
+   Feed-forward compressor in the log domain, the same dB domain as the gain
+   law.  Per sample:
+
+   1. `level[t] = 20 log10 |x[t]|`, vectorized with a fast log2.
+   2. `target[t]`, the gain change from the static curve (threshold, ratio
+      and soft knee), vectorized and branchless.  The curve may instead come
+      from a table sampled from Julia (see `curve!` in amp.jl).
+   3. `env[t]` follows `target` with the attack coefficient while the
+      reduction grows and the release coefficient while it shrinks.  This is
+      a recurrence that picks its coefficient from its own last value, so it
+      stays scalar, as in the limiter.
+   4. `g[t] = 10^(env[t] / 20)`, vectorized with a fast exp2.
+   5. The input is multiplied by `g`, with the usual kernel.
+
+   No lookahead, so no latency.  `compressor_process()` never allocates.
+*/
+typedef struct {
+    float threshold;  // dB
+    float slope;      // 1 / ratio - 1, the gain change per dB over the threshold
+    float knee;       // dB, width of the soft knee, 0 for a hard knee
+    float attack;     // One-pole coefficient per sample
+    float release;    // One-pole coefficient per sample
+
+    const SharedTable* curve;  // If set, replaces threshold, slope and knee
+    float              env;    // Current gain change in dB, <= 0
+} Compressor;
+
+/** Samples processed per vector pass, sized to stay in L1. */
+#define COMPRESSOR_CHUNK 256
+
+/** Levels of silence and of the sampled curve's ends, in dB. */
+#define COMPRESSOR_FLOOR_DB -120.0f
+#define COMPRESSOR_CURVE_LO -120.0f
+#define COMPRESSOR_CURVE_STEP 0.05f
+#define COMPRESSOR_CURVE_COUNT 2881  // Up to +24 dB
+
+static inline float
+compressor_coef(double ms, double rate)
+{
+    return ms > 0.0 ? (float)exp(-1.0 / (0.001 * ms * rate)) : 0.0f;
+}
+
+static inline void
+compressor_reset(Compressor* comp)
+{
+    comp->env = 0.0f;
+}
+
+static inline void
+compressor_set(Compressor* comp, float threshold, float ratio, float knee, float attack_ms,
+               float release_ms, double rate)
+{
+    comp->threshold = threshold;
+    comp->slope     = 1.0f / (ratio < 1.0f ? 1.0f : ratio) - 1.0f;
+    comp->knee      = knee > 0.0f ? knee : 0.0f;
+    comp->attack    = compressor_coef(attack_ms, rate);
+    comp->release   = compressor_coef(release_ms, rate);
+}
+
+/**
+   log2(x) for x > 0.  The mantissa is brought to [sqrt(1/2), sqrt(2)) and
+   log2(m) = 2 / ln 2 * atanh((m - 1) / (m + 1)), to 1e-7 with four terms of
+   the series.  Zero and denormals (flushed) come out near -127.
+*/
+static inline v4f
+v4f_log2(v4f x)
+{
+    const v4i bits = (v4i)x;
+    v4i       e    = ((bits >> 23) & 0xFF) - 127;
+    v4f       m    = (v4f)((bits & 0x007FFFFF) | 0x3F800000);  // [1, 2)
+
+    const v4i big  = m > 1.41421356f;
+    m              = big ? m * 0.5f : m;
+    e             += big & 1;
+
+    const v4f one = {1.0f, 1.0f, 1.0f, 1.0f};
+    const v4f s   = (m - one) / (m + one);
+    const v4f s2  = s * s;
+    const v4f p   = s * (2.88539008f + s2 * (0.961796694f + s2 * (0.577078016f + s2 * 0.412198583f)));
+    return p + __builtin_convertvector(e, v4f);
+}
+
+/**
+   2^x for x in [-126, 126] (clamped).  Rounds to x = i + f with |f| <= 1/2,
+   then 2^f from a degree 6 Taylor polynomial, to 1e-6 relative.
+*/
+static inline v4f
+v4f_exp2(v4f x)
+{
+    const v4f lo = {-126.0f, -126.0f, -126.0f, -126.0f};
+    const v4f hi = {126.0f, 126.0f, 126.0f, 126.0f};
+    x            = x < lo ? lo : x;
+    x            = x > hi ? hi : x;
+
+    const v4f half = {0.5f, 0.5f, 0.5f, 0.5f};
+    const v4i i    = __builtin_convertvector(x + (x < 0.0f ? -half : half), v4i);  // Round
+    const v4f f    = x - __builtin_convertvector(i, v4f);
+
+    // e^(f ln 2), Horner on the Taylor coefficients of 2^f
+    const v4f p = 1.0f + f * (0.693147181f + f * (0.240226507f + f * (0.0555041087f +
+                  f * (0.00961812911f + f * (0.00133335581f + f * 0.000154035304f)))));
+    return (v4f)((v4i)p + (i << 23));
+}
+
+/** level[i] = 20 log10 |x[i]|, at least COMPRESSOR_FLOOR_DB, which NaN and Inf also get. */
+static inline void
+compressor_level(float* level, const float* x, uint32_t n)
+{
+    const v4i abs_mask = {0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF};
+    const v4f db       = {6.02059991f, 6.02059991f, 6.02059991f, 6.02059991f};  // 20 log10(2)
+    const v4f floor_db = {COMPRESSOR_FLOOR_DB, COMPRESSOR_FLOOR_DB, COMPRESSOR_FLOOR_DB,
+                          COMPRESSOR_FLOOR_DB};
+    uint32_t  pos      = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f a = (v4f)((v4i)v4f_load(x + pos) & abs_mask);
+        const v4f l = v4f_log2(a) * db;
+        v4f_store(level + pos, (l > floor_db) & ((a - a) == 0.0f) ? l : floor_db);
+    }
+    for (; pos < n; pos++) {
+        const float a = fabsf(x[pos]);
+        const float l = a > 0.0f && is_finite(a) ? 20.0f * log10f(a) : COMPRESSOR_FLOOR_DB;
+        level[pos]    = l > COMPRESSOR_FLOOR_DB ? l : COMPRESSOR_FLOOR_DB;
+    }
+}
+
+/**
+   Static curve, the gain change for each level.  With d = level - threshold
+   and knee W:
+
+     d <= -W/2:       0
+     |d| < W/2:       slope * (d + W/2)^2 / (2W)
+     d >= W/2:        slope * d
+
+   computed without branches as slope * (a^2 / 2W + max(d - W/2, 0)) with
+   a = clamp(d + W/2, 0, W).
+*/
+static inline void
+compressor_curve(const Compressor* comp, float* target, const float* level, uint32_t n)
+{
+    if (comp->curve) {
+        for (uint32_t pos = 0; pos < n; pos++) {
+            target[pos] = shared_table_lookup(comp->curve, level[pos]);
+        }
+        return;
+    }
+
+    const float W      = comp->knee > 1e-3f ? comp->knee : 1e-3f;
+    const v4f   zero   = {0.0f, 0.0f, 0.0f, 0.0f};
+    const v4f   thresh = {comp->threshold, comp->threshold, comp->threshold, comp->threshold};
+    const v4f   w      = {W, W, W, W};
+    const v4f   half_w = w * 0.5f;
+    const v4f   inv_2w = 0.5f / w;
+    const v4f   slope  = {comp->slope, comp->slope, comp->slope, comp->slope};
+    uint32_t    pos    = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f d    = v4f_load(level + pos) - thresh;
+        v4f       a    = d + half_w;
+        a              = a > zero ? a : zero;
+        a              = a < w ? a : w;
+        const v4f over = d - half_w;
+        v4f_store(target + pos, slope * (a * a * inv_2w + (over > zero ? over : zero)));
+    }
+    for (; pos < n; pos++) {
+        const float d    = level[pos] - comp->threshold;
+        const float a    = std::min(std::max(d + 0.5f * W, 0.0f), W);
+        const float over = d - 0.5f * W;
+        target[pos]      = comp->slope * (a * a * (0.5f / W) + (over > 0.0f ? over : 0.0f));
+    }
+}
+
+/** env[i] follows target[i], attacking downwards and releasing upwards. */
+static inline void
+compressor_envelope(Compressor* comp, float* env, const float* target, uint32_t n)
+{
+    const float attack  = comp->attack;
+    const float release = comp->release;
+    float       e       = comp->env;
+    for (uint32_t pos = 0; pos < n; pos++) {
+        const float t = target[pos];
+        const float c = t < e ? attack : release;
+        e             = t + c * (e - t);
+        env[pos]      = e;
+    }
+    comp->env = e;
+}
+
+/** gain[i] = 10^(db[i] / 20) */
+static inline void
+compressor_gains(float* gain, const float* db, uint32_t n)
+{
+    const v4f scale = {0.166096405f, 0.166096405f, 0.166096405f, 0.166096405f};  // log2(10) / 20
+    uint32_t  pos   = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        v4f_store(gain + pos, v4f_exp2(v4f_load(db + pos) * scale));
+    }
+    for (; pos < n; pos++) {
+        gain[pos] = exp2f(db[pos] * 0.166096405f);
+    }
+}
+
+template <bool Sanitize>
+static inline void
+compressor_process(Compressor* comp, float* out, const float* in, uint32_t n)
+{
+    float level[COMPRESSOR_CHUNK];
+    float gain[COMPRESSOR_CHUNK];
+
+    for (uint32_t offset = 0; offset < n; offset += COMPRESSOR_CHUNK) {
+        const uint32_t chunk = n - offset < COMPRESSOR_CHUNK ? n - offset : COMPRESSOR_CHUNK;
+        compressor_level(level, in + offset, chunk);
+        compressor_curve(comp, gain, level, chunk);
+        compressor_envelope(comp, level, gain, chunk);
+        compressor_gains(gain, level, chunk);
+        apply_gains<Sanitize>(out + offset, in + offset, gain, chunk);
+    }
+}
+
+#endif  // AMP_COMPRESSOR_HPP
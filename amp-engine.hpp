@@ -0,0 +1,389 @@
+#ifndef AMP_ENGINE_HPP
+#define AMP_ENGINE_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include "amp-table.hpp"
+#include "julia-amp.h"
+
+/**
+   Shared Julia engine.
+
+   Hosts that sandbox every plugin in its own process would otherwise start
+   a Julia runtime in each of them.  With JULIA_AMP_ENGINE=1 the plugin
+   instead connects to `julia-amp-engine`, a local daemon that runs Julia
+   once for all processes using the same bundle, and starts it on demand.
+
+   Each instance connects over a Unix socket and sends an `EngineHello`
+   along with a memfd holding its `EngineChannel`.  Block data never goes
+   through the socket: for every call, the instance fills the channel, writes
+   one byte to the socket as a doorbell, and blocks reading one byte back,
+   after which the result is in the channel.  `run()` waits for every result
+   anyway, so the channel holds one request at a time.  It waits for at most
+   the timeout set with `engine_client_timeout()`, about one block, so a
+   stalled engine fails the call instead of hanging the host's audio thread.
+
+   The engine exits once it has had no clients for JULIA_AMP_ENGINE_IDLE
+   seconds (60 by default).
+
+   The socket lives in XDG_RUNTIME_DIR, or else in a directory of /tmp that
+   only the user can enter.  Both ends check that the other runs as the same
+   user, since the channel is writable shared memory and the answers go
+   straight into the audio.
+*/
+
+#define ENGINE_MAGIC     0x454D414Au  // "JAME"
+#define ENGINE_VERSION   3
+#define ENGINE_MAX_BLOCK 8192  // Samples per call, longer blocks are split
+#define ENGINE_BINARY    "julia-amp-engine"
+#define ENGINE_START_MS  20000  // How long to wait for a fresh engine
+
+typedef enum {
+    ENGINE_OP_COEF    = 1,  // result = db_to_coef(gain)
+    ENGINE_OP_COEFS   = 2,  // coefs! from `in` to `out`, result for gain alone
+    ENGINE_OP_PROCESS = 3   // The process! kernel from `in` to `out`
+} EngineOp;
+
+typedef enum {
+    ENGINE_JULIA_KERNEL = 1u << 0,  // Compile the process! kernel (JULIA_AMP_JULIA_KERNEL=1)
+    ENGINE_SANITIZE     = 1u << 1
+} EngineFlags;
+
+/** Shared by an instance and the engine, one request at a time. */
+typedef struct {
+    uint32_t op;
+    uint32_t n;
+    float    gain;
+    float    result;
+    uint32_t failed;  // Julia threw or returned something that is not a Float32
+    char     stage[16];
+    char     what[128];
+    float    in[ENGINE_MAX_BLOCK];
+    float    out[ENGINE_MAX_BLOCK];
+} EngineChannel;
+
+/** First message of a connection, sent with the channel's file descriptor. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t block_length;
+    uint64_t script_hash;  // hash_file() of the amp.jl the instance expects
+} EngineHello;
+
+/** The engine's answer, after it has tested db_to_coef for the instance. */
+typedef struct {
+    uint32_t failed;
+    float    coef;  // db_to_coef(-3)
+    char     stage[16];
+    char     what[128];
+
+    JuliaAmpKernelReport report;  // For ENGINE_JULIA_KERNEL, zero if unavailable
+} EngineWelcome;
+
+typedef struct {
+    int            sock;
+    EngineChannel* channel;
+} EngineClient;
+
+/**
+   One engine per user, bundle and version of amp.jl.  After amp.jl changes,
+   instances start a new engine, and the old one exits once its own
+   instances are gone.
+*/
+static inline bool
+engine_socket_path(const char* bundle_path, uint64_t script_hash, char* buf, size_t len)
+{
+    uint64_t hash = fnv1a(0xCBF29CE484222325ull, bundle_path, strlen(bundle_path));
+    hash          = fnv1a(hash, &script_hash, sizeof(script_hash));
+
+    char        private_dir[64];
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) {
+        // Anyone can create names in /tmp, so only use a directory that is
+        // ours and closed to everyone else, whoever created it
+        struct stat st;
+        snprintf(private_dir, sizeof(private_dir), "/tmp/julia-amp-%u", (unsigned)geteuid());
+        mkdir(private_dir, 0700);
+        if (lstat(private_dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+            (st.st_mode & 077)) {
+            fprintf(stderr, "julia-amp: %s is not a private directory\n", private_dir);
+            return false;
+        }
+        dir = private_dir;
+    }
+    // A cut path would lose the hash at its end and mix up engines
+    const int n = snprintf(buf, len, "%s/julia-amp-engine-%u-%016llx.sock",
+                           dir, (unsigned)geteuid(), (unsigned long long)hash);
+    if (n < 0 || (size_t)n >= len || (size_t)n >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        fprintf(stderr, "julia-amp: engine socket path in %s is too long\n", dir);
+        return false;
+    }
+    return true;
+}
+
+/** Fills in the address of the socket at `path`, returns false if it does not fit. */
+static inline bool
+engine_socket_addr(const char* path, struct sockaddr_un* addr)
+{
+    const size_t len = strlen(path);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (len >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    memcpy(addr->sun_path, path, len + 1);
+    return true;
+}
+
+/** Whether the process at the other end of `sock` runs as this user. */
+static inline bool
+engine_peer_trusted(int sock)
+{
+    struct ucred cred;
+    socklen_t    len = sizeof(cred);
+    return !getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == geteuid();
+}
+
+static inline int
+engine_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    if (!engine_socket_addr(path, &addr)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock >= 0 && connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static inline bool
+engine_spawn(const char* bundle_path, const char* socket_path)
+{
+    char binary[1024];
+    snprintf(binary, sizeof(binary), "%s/" ENGINE_BINARY, bundle_path);
+
+    extern char** environ;
+    char* const   argv[] = {binary, (char*)bundle_path, (char*)socket_path, NULL};
+    pid_t         pid;
+    if (posix_spawn(&pid, binary, NULL, NULL, argv, environ)) {
+        return false;
+    }
+    return true;  // The engine detaches itself; its exit status is not ours to reap
+}
+
+static inline void
+engine_set_timeout(int sock, uint32_t us)
+{
+    struct timeval timeout = {(time_t)(us / 1000000), (suseconds_t)(us % 1000000)};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static inline bool
+engine_send_all(int sock, const void* buf, size_t len)
+{
+    for (size_t done = 0; done < len;) {
+        const ssize_t r = send(sock, (const char*)buf + done, len - done, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r <= 0) {
+            return false;
+        }
+        done += r;
+    }
+    return true;
+}
+
+static inline bool
+engine_recv_all(int sock, void* buf, size_t len)
+{
+    for (size_t done = 0; done < len;) {
+        const ssize_t r = recv(sock, (char*)buf + done, len - done, 0);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r <= 0) {
+            return false;
+        }
+        done += r;
+    }
+    return true;
+}
+
+/** Sends `len` bytes of `buf` with `fd` attached. */
+static inline bool
+engine_send_fd(int sock, const void* buf, size_t len, int fd)
+{
+    char          control[CMSG_SPACE(sizeof(int))];
+    struct iovec  iov = {(void*)buf, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+/** Receives exactly `len` bytes into `buf` and the attached descriptor, or -1. */
+static inline int
+engine_recv_fd(int sock, void* buf, size_t len)
+{
+    char          control[CMSG_SPACE(sizeof(int))];
+    struct iovec  iov = {buf, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)len) {
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+static inline void
+engine_client_close(EngineClient* client)
+{
+    if (client->channel) {
+        munmap(client->channel, sizeof(EngineChannel));
+    }
+    if (client->sock > 0) {
+        close(client->sock);
+    }
+    memset(client, 0, sizeof(EngineClient));
+}
+
+/**
+   Connects to the engine for `bundle_path`, starting it if it is not
+   running, and sets up a channel.  Fills `welcome` on success.
+*/
+static inline bool
+engine_client_open(EngineClient*    client,
+                   const char*      bundle_path,
+                   const EngineHello* hello,
+                   EngineWelcome*   welcome)
+{
+    typedef std::chrono::steady_clock clock;
+
+    memset(client, 0, sizeof(EngineClient));
+
+    char path[1024];
+    if (!engine_socket_path(bundle_path, hello->script_hash, path, sizeof(path))) {
+        return false;
+    }
+    int sock = engine_connect(path);
+    if (sock < 0) {
+        if (!engine_spawn(bundle_path, path)) {
+            fprintf(stderr, "julia-amp: cannot start %s/" ENGINE_BINARY "\n", bundle_path);
+            return false;
+        }
+        // An engine that was exiting can still hold the lock, then ours
+        // leaves quietly, so spawn again every second until one answers
+        const clock::time_point start    = clock::now();
+        const clock::time_point deadline = start + std::chrono::milliseconds(ENGINE_START_MS);
+        clock::time_point       respawn  = start + std::chrono::seconds(1);
+        while ((sock = engine_connect(path)) < 0 && clock::now() < deadline) {
+            if (clock::now() >= respawn) {
+                engine_spawn(bundle_path, path);
+                respawn += std::chrono::seconds(1);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (sock < 0) {
+            fprintf(stderr, "julia-amp: engine did not come up at %s\n", path);
+            return false;
+        }
+    }
+    if (!engine_peer_trusted(sock)) {
+        fprintf(stderr, "julia-amp: engine at %s runs as another user\n", path);
+        close(sock);
+        return false;
+    }
+
+    // The engine may compile a kernel before it answers
+    engine_set_timeout(sock, ENGINE_START_MS * 1000u);
+
+    const int fd = memfd_create("julia-amp-channel", MFD_CLOEXEC);
+    void*     map = (fd >= 0 && !ftruncate(fd, sizeof(EngineChannel)))
+                        ? mmap(NULL, sizeof(EngineChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                        : MAP_FAILED;
+    const bool sent = map != MAP_FAILED && engine_send_fd(sock, hello, sizeof(*hello), fd);
+    if (fd >= 0) {
+        close(fd);  // The mappings keep the memory
+    }
+    if (!sent || !engine_recv_all(sock, welcome, sizeof(*welcome))) {
+        if (map != MAP_FAILED) {
+            munmap(map, sizeof(EngineChannel));
+        }
+        close(sock);
+        return false;
+    }
+
+    client->sock    = sock;
+    client->channel = (EngineChannel*)map;
+    return true;
+}
+
+/** Sets how long `engine_call()` waits for an answer. */
+static inline void
+engine_client_timeout(EngineClient* client, uint32_t us)
+{
+    engine_set_timeout(client->sock, us);
+}
+
+/**
+   Runs the request in the channel, returns false if the engine is gone or
+   did not answer in time, with errno set to EAGAIN for the latter.  A late
+   answer would be taken for the next call's, so after either the connection
+   is shut down and every later call fails right away.
+*/
+static inline bool
+engine_call(EngineClient* client)
+{
+    char doorbell = (char)client->channel->op;
+    if (engine_send_all(client->sock, &doorbell, 1) &&
+        engine_recv_all(client->sock, &doorbell, 1)) {
+        return true;
+    }
+    const int error = errno;
+    shutdown(client->sock, SHUT_RDWR);
+    errno = error == EWOULDBLOCK ? EAGAIN : error;
+    return false;
+}
+
+#endif  // AMP_ENGINE_HPP
@@ -0,0 +1,385 @@
+#ifndef AMP_KERNELS_HPP
+#define AMP_KERNELS_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+/**
+   Flush-to-zero / denormals-are-zero for the lifetime of the object.
+
+   Denormal floats take a microcode assist on most CPUs and can make quiet
+   passages through a feedback path tens of times slower than loud ones.  The
+   previous floating point control state is restored on destruction, so the
+   guard is safe to place around any processing path, including on host
+   threads that we do not own.
+*/
+class ScopedDenormals {
+#if defined(__SSE__)
+    unsigned int saved;
+
+public:
+    ScopedDenormals() : saved{_mm_getcsr()} { _mm_setcsr(saved | 0x8040); }  // FTZ | DAZ
+    ~ScopedDenormals() { _mm_setcsr(saved); }
+#elif defined(__aarch64__)
+    uint64_t saved;
+
+public:
+    ScopedDenormals() {
+        asm volatile("mrs %0, fpcr" : "=r"(saved));
+        asm volatile("msr fpcr, %0" ::"r"(saved | (1ULL << 24)));  // FZ
+    }
+    ~ScopedDenormals() { asm volatile("msr fpcr, %0" ::"r"(saved)); }
+#else
+public:
+    ScopedDenormals() {}
+#endif
+    ScopedDenormals(const ScopedDenormals&) = delete;
+    ScopedDenormals& operator=(const ScopedDenormals&) = delete;
+};
+
+/**
+   Returns `x` if it is finite and 0 otherwise.  `x - x` is 0 for every finite
+   value and NaN for NaN and infinities, so this compiles to a compare and a
+   mask instead of a branch.
+*/
+static inline float
+sanitize(float x)
+{
+    return (x - x == 0.0f) ? x : 0.0f;
+}
+
+static inline bool
+is_finite(float x)
+{
+    return x - x == 0.0f;
+}
+
+/**
+   Vector kernels.  These use the GCC/Clang vector extensions rather than
+   intrinsics, so they compile to SSE, AVX or NEON depending on the target
+   flags.  Loads and stores go through memcpy since LV2 buffers carry no
+   alignment guarantee and may alias (hosts are allowed to run in-place).
+*/
+typedef float   v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+static inline v4f
+v4f_load(const float* p)
+{
+    v4f v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void
+v4f_store(float* p, v4f v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline v4f
+v4f_sanitize(v4f x)
+{
+    const v4i finite = (x - x) == (v4f){0.0f, 0.0f, 0.0f, 0.0f};
+    return (v4f)((v4i)x & finite);
+}
+
+typedef float   v8f __attribute__((vector_size(32)));
+typedef int32_t v8i __attribute__((vector_size(32)));
+
+/** out[i] = in[i] * coef, one sample at a time. */
+template <bool Sanitize>
+static inline void
+apply_gain_scalar(float* out, const float* in, float coef, uint32_t n)
+{
+    for (uint32_t pos = 0; pos < n; pos++) {
+        const float y = in[pos] * coef;
+        out[pos]      = Sanitize ? sanitize(y) : y;
+    }
+}
+
+/** out[i] = in[i] * coef, with the NaN/Inf guard fused into the store. */
+template <bool Sanitize>
+static inline void
+apply_gain(float* out, const float* in, float coef, uint32_t n)
+{
+    const v4f c   = {coef, coef, coef, coef};
+    uint32_t  pos = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        v4f y = v4f_load(in + pos) * c;
+        v4f_store(out + pos, Sanitize ? v4f_sanitize(y) : y);
+    }
+    for (; pos < n; pos++) {
+        const float y = in[pos] * coef;
+        out[pos]      = Sanitize ? sanitize(y) : y;
+    }
+}
+
+/**
+   8 lanes per iteration: one AVX register, or two SSE/NEON registers.  The
+   8-wide vector type is only used with AVX, since GCC splits it badly on
+   narrower targets and its calling convention differs with and without AVX.
+*/
+template <bool Sanitize>
+static inline void
+apply_gain_v8(float* out, const float* in, float coef, uint32_t n)
+{
+    uint32_t pos = 0;
+#if defined(__AVX__)
+    const v8f c    = {coef, coef, coef, coef, coef, coef, coef, coef};
+    const v8f zero = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    for (; pos + 8 <= n; pos += 8) {
+        v8f y;
+        memcpy(&y, in + pos, sizeof(y));
+        y *= c;
+        if (Sanitize) {
+            y = (v8f)((v8i)y & ((y - y) == zero));
+        }
+        memcpy(out + pos, &y, sizeof(y));
+    }
+#else
+    const v4f c = {coef, coef, coef, coef};
+    for (; pos + 8 <= n; pos += 8) {
+        const v4f a = v4f_load(in + pos) * c;
+        const v4f b = v4f_load(in + pos + 4) * c;
+        v4f_store(out + pos, Sanitize ? v4f_sanitize(a) : a);
+        v4f_store(out + pos + 4, Sanitize ? v4f_sanitize(b) : b);
+    }
+#endif
+    apply_gain<Sanitize>(out + pos, in + pos, coef, n - pos);
+}
+
+/** out[i] = in[i] * g[i], for gains that vary per sample. */
+template <bool Sanitize>
+static inline void
+apply_gains(float* out, const float* in, const float* g, uint32_t n)
+{
+    uint32_t pos = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f y = v4f_load(in + pos) * v4f_load(g + pos);
+        v4f_store(out + pos, Sanitize ? v4f_sanitize(y) : y);
+    }
+    for (; pos < n; pos++) {
+        const float y = in[pos] * g[pos];
+        out[pos]      = Sanitize ? sanitize(y) : y;
+    }
+}
+
+/**
+   out[k][i] = in[i] * coefs[k] for each of `n_coefs` outputs: one input
+   against a sweep of gains.  Every vector of the input is loaded once and
+   multiplied by all the coefficients, so the input is read once however
+   many outputs there are.
+*/
+template <bool Sanitize>
+static inline void
+apply_gain_sweep(float* const* out, const float* in, const float* coefs, uint32_t n_coefs,
+                 uint32_t n)
+{
+    uint32_t pos = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f x = v4f_load(in + pos);
+        for (uint32_t k = 0; k < n_coefs; ++k) {
+            const v4f y = x * coefs[k];
+            v4f_store(out[k] + pos, Sanitize ? v4f_sanitize(y) : y);
+        }
+    }
+    for (; pos < n; pos++) {
+        for (uint32_t k = 0; k < n_coefs; ++k) {
+            const float y = in[pos] * coefs[k];
+            out[k][pos]   = Sanitize ? sanitize(y) : y;
+        }
+    }
+}
+
+/**
+   out[i] goes linearly from `from` (exclusive) to `to` (inclusive), the same
+   ramp as `apply_ramp()` uses.  This interpolates control-rate values back to
+   audio rate.
+*/
+static inline void
+fill_ramp(float* out, float from, float to, uint32_t n)
+{
+    const float step = n ? (to - from) / (float)n : 0.0f;
+    const v4f   s4   = {4.0f * step, 4.0f * step, 4.0f * step, 4.0f * step};
+    v4f         g    = {from + step, from + 2.0f * step, from + 3.0f * step, from + 4.0f * step};
+    uint32_t    pos  = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        v4f_store(out + pos, g);
+        g += s4;
+    }
+    for (; pos < n; pos++) {
+        out[pos] = from + step * (float)(pos + 1);
+    }
+    if (n) {
+        out[n - 1] = to;  // Exact, whatever the rounding of the steps
+    }
+}
+
+/** Returns max |x[i]|, or 0 for an empty block. */
+static inline float
+peak_abs(const float* x, uint32_t n)
+{
+    const v4i abs_mask = {0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF};
+    v4f       peak     = {0.0f, 0.0f, 0.0f, 0.0f};
+    uint32_t  pos      = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f a = (v4f)((v4i)v4f_load(x + pos) & abs_mask);
+        peak        = a > peak ? a : peak;
+    }
+    float result = 0.0f;
+    for (int i = 0; i < 4; ++i) {
+        result = peak[i] > result ? peak[i] : result;
+    }
+    for (; pos < n; pos++) {
+        const float a = x[pos] < 0.0f ? -x[pos] : x[pos];
+        result        = a > result ? a : result;
+    }
+    return result;
+}
+
+/**
+   out[i] = in[i] * g[i], with g going linearly from `from` (exclusive) to `to`
+   (inclusive) over the block, so consecutive ramps join without a step.
+*/
+template <bool Sanitize>
+static inline void
+apply_ramp(float* out, const float* in, float from, float to, uint32_t n)
+{
+    const float step = n ? (to - from) / (float)n : 0.0f;
+    const v4f   s4   = {4.0f * step, 4.0f * step, 4.0f * step, 4.0f * step};
+    v4f         g    = {from + step, from + 2.0f * step, from + 3.0f * step, from + 4.0f * step};
+    uint32_t    pos  = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f y = v4f_load(in + pos) * g;
+        v4f_store(out + pos, Sanitize ? v4f_sanitize(y) : y);
+        g += s4;
+    }
+    for (; pos < n; pos++) {
+        const float y = in[pos] * (from + step * (float)(pos + 1));
+        out[pos]      = Sanitize ? sanitize(y) : y;
+    }
+}
+
+/** out[i] = a[i] * ga + b[i] * gb, for crossfades and dry/wet mixing. */
+template <bool Sanitize>
+static inline void
+apply_mix(float* out, const float* a, float ga, const float* b, float gb, uint32_t n)
+{
+    const v4f ca  = {ga, ga, ga, ga};
+    const v4f cb  = {gb, gb, gb, gb};
+    uint32_t  pos = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f y = v4f_load(a + pos) * ca + v4f_load(b + pos) * cb;
+        v4f_store(out + pos, Sanitize ? v4f_sanitize(y) : y);
+    }
+    for (; pos < n; pos++) {
+        const float y = a[pos] * ga + b[pos] * gb;
+        out[pos]      = Sanitize ? sanitize(y) : y;
+    }
+}
+
+/**
+   out[i] = wet[i] * g[i] + dry[i] * (1 - g[i]), with g ramping like in
+   `apply_ramp()`.  `out` may be `wet`.
+*/
+static inline void
+apply_crossfade(float* out, const float* wet, const float* dry, float from, float to, uint32_t n)
+{
+    const float step = n ? (to - from) / (float)n : 0.0f;
+    const v4f   one  = {1.0f, 1.0f, 1.0f, 1.0f};
+    const v4f   s4   = {4.0f * step, 4.0f * step, 4.0f * step, 4.0f * step};
+    v4f         g    = {from + step, from + 2.0f * step, from + 3.0f * step, from + 4.0f * step};
+    uint32_t    pos  = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        v4f_store(out + pos, v4f_load(wet + pos) * g + v4f_load(dry + pos) * (one - g));
+        g += s4;
+    }
+    for (; pos < n; pos++) {
+        const float gi = from + step * (float)(pos + 1);
+        out[pos]       = wet[pos] * gi + dry[pos] * (1.0f - gi);
+    }
+}
+
+typedef void (*GainKernel)(float* out, const float* in, float coef, uint32_t n);
+
+/**
+   Gain for a block length known at compile time.  With a constant trip count
+   that is a multiple of the vector width, the compiler emits straight-line
+   code with no loop counter and no remainder loop.
+*/
+template <uint32_t N, bool Sanitize>
+static void
+apply_gain_fixed(float* out, const float* in, float coef, uint32_t)
+{
+    static_assert(N % 4 == 0, "block length must be a multiple of 4");
+
+    const v4f c = {coef, coef, coef, coef};
+#pragma GCC unroll 256
+    for (uint32_t pos = 0; pos < N; pos += 4) {
+        const v4f y = v4f_load(in + pos) * c;
+        v4f_store(out + pos, Sanitize ? v4f_sanitize(y) : y);
+    }
+}
+
+/**
+   Dispatches power-of-two block lengths from 32 to 1024 to a specialized
+   kernel through a table indexed by log2(n), and everything else to the
+   generic 4-wide kernel.
+*/
+template <bool Sanitize>
+static inline void
+apply_gain_dispatch(float* out, const float* in, float coef, uint32_t n)
+{
+    static const GainKernel fixed[] = {
+        apply_gain_fixed<32, Sanitize>,
+        apply_gain_fixed<64, Sanitize>,
+        apply_gain_fixed<128, Sanitize>,
+        apply_gain_fixed<256, Sanitize>,
+        apply_gain_fixed<512, Sanitize>,
+        apply_gain_fixed<1024, Sanitize>,
+    };
+
+    if (n >= 32 && n <= 1024 && !(n & (n - 1))) {
+        fixed[__builtin_ctz(n) - 5](out, in, coef, n);
+    } else {
+        apply_gain<Sanitize>(out, in, coef, n);
+    }
+}
+
+/**
+   Equivalent implementations of the gain stage.  Which one is fastest
+   depends on the CPU and the block length, so the choice is made at run time
+   (see amp-tune.hpp).  The first entry is the default.
+*/
+typedef struct {
+    const char* name;
+    GainKernel  plain;
+    GainKernel  sanitized;
+} GainKernelInfo;
+
+static const GainKernelInfo gain_kernels[] = {
+    {"v4", apply_gain<false>, apply_gain<true>},
+    {"scalar", apply_gain_scalar<false>, apply_gain_scalar<true>},
+    {"v8", apply_gain_v8<false>, apply_gain_v8<true>},
+    {"fixed", apply_gain_dispatch<false>, apply_gain_dispatch<true>},
+};
+
+static const uint32_t n_gain_kernels = sizeof(gain_kernels) / sizeof(gain_kernels[0]);
+
+static inline const GainKernelInfo*
+find_gain_kernel(const char* name)
+{
+    for (uint32_t i = 0; i < n_gain_kernels; ++i) {
+        if (!strcmp(gain_kernels[i].name, name)) {
+            return &gain_kernels[i];
+        }
+    }
+    return NULL;
+}
+
+#endif  // AMP_KERNELS_HPP
@@ -0,0 +1,285 @@
+#ifndef AMP_LIMITER_HPP
+#define AMP_LIMITER_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "amp-kernels.hpp"
+
+/**
+   Lookahead brickwall limiter.
+
+   With a window of W samples, the signal is delayed by W - 1 samples and
+   each output sample is multiplied by a gain that is guaranteed not to push
+   it over the ceiling:
+
+   1. `need[t] = min(1, ceiling / |x[t]|)`, vectorized.
+   2. `m[t]` is the minimum of `need` over the last W samples, from a
+      monotonic deque (amortized O(1) per sample).
+   3. `r[t] = min(m[t], release(r[t - 1]))` recovers slowly towards 1 but
+      follows `m` down instantly.  It is tracked as the reduction `1 - r`,
+      which keeps the per-sample dependency chain to one multiply and one max.
+   4. `g[t]` is the mean of `r` over the last W samples, which turns the
+      steps of `r` into ramps.  Every `r` in that mean is at most
+      `need[t - W + 1]`, so `x[t - W + 1] * g[t]` never exceeds the ceiling.
+   5. The delayed signal is multiplied by `g`, vectorized.
+
+   Steps 2 to 4 are recurrences and stay scalar.
+
+   The limiter also keeps a second delay line of the same length for the dry
+   signal, fed by `limiter_dry()`, so that a bypassed signal has the same
+   latency as the limited one.  `limiter_prime()` refills the limiter from
+   it after a bypass.
+
+   All memory is allocated by `limiter_init()` for the largest window; the
+   other functions never allocate.
+*/
+typedef struct {
+    uint32_t capacity;  // Largest window, in samples
+    uint32_t window;    // Current window W, in samples
+    float    ceiling;   // Linear
+    float    release;   // One-pole coefficient per sample
+
+    uint64_t t;          // Samples processed since reset
+    float*   delay;      // Input history, W - 1 samples used
+    uint32_t delay_pos;  // Next slot, t % (W - 1)
+    float*   box;        // `r` history for the mean, W values used
+    uint32_t box_pos;    // Next slot, t % W
+    double   sum;        // Sum of the last W values of `r`
+    float    reduction;  // 1 - r
+    float*   dry;        // Dry input history, W - 1 samples used
+    uint32_t dry_pos;    // Next slot
+
+    // Monotonic deque of (time, need) with increasing `need`
+    uint64_t* dq_time;
+    float*    dq_need;
+    uint32_t  dq_head;
+    uint32_t  dq_size;
+} Limiter;
+
+/** Samples processed per vector pass, sized to stay in L1. */
+#define LIMITER_CHUNK 256
+
+static inline void
+limiter_free(Limiter* lim)
+{
+    free(lim->delay);
+    free(lim->dry);
+    free(lim->box);
+    free(lim->dq_time);
+    free(lim->dq_need);
+    memset(lim, 0, sizeof(Limiter));
+}
+
+/** Restarts with an empty lookahead and no reduction, keeping the dry history. */
+static inline void
+limiter_restart(Limiter* lim)
+{
+    lim->t         = 0;
+    lim->delay_pos = 0;
+    lim->box_pos   = 0;
+    lim->sum       = (double)lim->window;  // History of r = 1
+    lim->reduction = 0.0f;
+    lim->dq_head   = 0;
+    lim->dq_size   = 0;
+    memset(lim->delay, 0, lim->capacity * sizeof(float));
+    for (uint32_t i = 0; i < lim->capacity; ++i) {
+        lim->box[i] = 1.0f;
+    }
+}
+
+static inline void
+limiter_reset(Limiter* lim, uint32_t window, float ceiling, float release)
+{
+    lim->window  = window < 1 ? 1 : window > lim->capacity ? lim->capacity : window;
+    lim->ceiling = ceiling;
+    lim->release = release;
+    lim->dry_pos = 0;
+    memset(lim->dry, 0, lim->capacity * sizeof(float));
+    limiter_restart(lim);
+}
+
+static inline bool
+limiter_init(Limiter* lim, uint32_t capacity)
+{
+    memset(lim, 0, sizeof(Limiter));
+    lim->capacity = capacity < 1 ? 1 : capacity;
+    lim->delay    = (float*)calloc(lim->capacity, sizeof(float));
+    lim->dry      = (float*)calloc(lim->capacity, sizeof(float));
+    lim->box      = (float*)calloc(lim->capacity, sizeof(float));
+    lim->dq_time  = (uint64_t*)calloc(lim->capacity, sizeof(uint64_t));
+    lim->dq_need  = (float*)calloc(lim->capacity, sizeof(float));
+    if (!lim->delay || !lim->dry || !lim->box || !lim->dq_time || !lim->dq_need) {
+        limiter_free(lim);
+        return false;
+    }
+    limiter_reset(lim, lim->capacity, 1.0f, 0.999f);
+    return true;
+}
+
+/** Latency of the limiter in samples. */
+static inline uint32_t
+limiter_latency(const Limiter* lim)
+{
+    return lim->window - 1;
+}
+
+/** need[i] = min(1, ceiling / |x[i]|), which is 1 for silence. */
+static inline void
+limiter_need(float* need, const float* x, float ceiling, uint32_t n)
+{
+    const v4i abs_mask = {0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF};
+    const v4f one      = {1.0f, 1.0f, 1.0f, 1.0f};
+    const v4f c        = {ceiling, ceiling, ceiling, ceiling};
+    uint32_t  pos      = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f a   = (v4f)((v4i)v4f_load(x + pos) & abs_mask);
+        const v4f req = c / a;  // +Inf for silence, NaN for NaN, both give 1
+        v4f_store(need + pos, req < one ? req : one);
+    }
+    for (; pos < n; pos++) {
+        const float a   = fabsf(x[pos]);
+        const float req = ceiling / a;
+        need[pos]       = req < 1.0f ? req : 1.0f;
+    }
+}
+
+static inline void
+limiter_process(Limiter* lim, float* out, const float* in, uint32_t n)
+{
+    float need[LIMITER_CHUNK];
+    float gain[LIMITER_CHUNK];
+    float delayed[LIMITER_CHUNK];
+
+    // Work on locals: the buffers are float*, so the compiler would otherwise
+    // reload every field of `lim` after each store
+    const uint32_t W          = lim->window;
+    const uint32_t cap        = lim->capacity;
+    const double   inv_window = 1.0 / W;
+    const float    release    = lim->release;
+    float* const   box        = lim->box;
+    float* const   delay      = lim->delay;
+    uint64_t* const dq_time   = lim->dq_time;
+    float* const   dq_need    = lim->dq_need;
+
+    uint64_t t         = lim->t;
+    uint32_t delay_pos = lim->delay_pos;
+    uint32_t box_pos   = lim->box_pos;
+    double   sum       = lim->sum;
+    float    reduction = lim->reduction;
+    uint32_t dq_head   = lim->dq_head;
+    uint32_t dq_size   = lim->dq_size;
+
+    for (uint32_t offset = 0; offset < n; offset += LIMITER_CHUNK) {
+        const uint32_t chunk = n - offset < LIMITER_CHUNK ? n - offset : LIMITER_CHUNK;
+        limiter_need(need, in + offset, lim->ceiling, chunk);
+
+        for (uint32_t i = 0; i < chunk; ++i, ++t) {
+            // Sliding minimum of `need` over [t - W + 1, t]
+            if (dq_size && dq_time[dq_head] + W <= t) {
+                dq_head = dq_head + 1 == cap ? 0 : dq_head + 1;
+                --dq_size;
+            }
+            uint32_t back = dq_head + dq_size;
+            back          = back >= cap ? back - cap : back;  // One past the back
+            while (dq_size) {
+                const uint32_t last = back ? back - 1 : cap - 1;
+                if (dq_need[last] < need[i]) {
+                    break;
+                }
+                back = last;
+                --dq_size;
+            }
+            dq_time[back] = t;
+            dq_need[back] = need[i];
+            ++dq_size;
+            const float m = dq_need[dq_head];
+
+            // Instant attack, one-pole release towards 1
+            const float released = reduction * release;
+            reduction            = 1.0f - m > released ? 1.0f - m : released;
+            const float r        = 1.0f - reduction;
+
+            // Mean of r over the window, and the matching input delay
+            sum += r - box[box_pos];
+            box[box_pos] = r;
+            box_pos      = box_pos + 1 == W ? 0 : box_pos + 1;
+            gain[i]      = (float)(sum * inv_window);
+
+            if (W > 1) {
+                delayed[i]       = delay[delay_pos];
+                delay[delay_pos] = in[offset + i];
+                delay_pos        = delay_pos + 2 == W ? 0 : delay_pos + 1;
+            } else {
+                delayed[i] = in[offset + i];
+            }
+        }
+
+        apply_gains<true>(out + offset, delayed, gain, chunk);
+    }
+
+    lim->t         = t;
+    lim->delay_pos = delay_pos;
+    lim->box_pos   = box_pos;
+    lim->sum       = sum;
+    lim->reduction = reduction;
+    lim->dq_head   = dq_head;
+    lim->dq_size   = dq_size;
+}
+
+/**
+   Delays `in` by the limiter's latency, without any gain, into `out`, which
+   may be `in`, or NULL to only keep the history for `limiter_prime()`.
+*/
+static inline void
+limiter_dry(Limiter* lim, float* out, const float* in, uint32_t n)
+{
+    const uint32_t W       = lim->window;
+    float* const   dry     = lim->dry;
+    uint32_t       dry_pos = lim->dry_pos;
+    if (W < 2) {
+        if (out && out != in) {
+            memcpy(out, in, n * sizeof(float));
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        const float x = in[i];
+        if (out) {
+            out[i] = dry[dry_pos];
+        }
+        dry[dry_pos] = x;
+        dry_pos      = dry_pos + 2 == W ? 0 : dry_pos + 1;
+    }
+    lim->dry_pos = dry_pos;
+}
+
+/**
+   Restarts the limiter and runs the dry history, times `coef`, through it,
+   so that its lookahead holds the recent input rather than silence or what
+   it held before a bypass.
+*/
+static inline void
+limiter_prime(Limiter* lim, float coef)
+{
+    float history[LIMITER_CHUNK];
+    float scratch[LIMITER_CHUNK];
+
+    limiter_restart(lim);
+    const uint32_t len = lim->window - 1;
+    for (uint32_t done = 0; done < len;) {
+        const uint32_t chunk = len - done < LIMITER_CHUNK ? len - done : LIMITER_CHUNK;
+        for (uint32_t i = 0; i < chunk; ++i) {
+            // The next slot of the dry line holds its oldest sample
+            uint32_t pos = lim->dry_pos + done + i;
+            pos          = pos >= len ? pos - len : pos;
+            history[i]   = lim->dry[pos] * coef;
+        }
+        limiter_process(lim, scratch, history, chunk);
+        done += chunk;
+    }
+}
+
+#endif  // AMP_LIMITER_HPP
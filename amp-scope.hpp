@@ -0,0 +1,275 @@
+#ifndef AMP_SCOPE_HPP
+#define AMP_SCOPE_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "lv2/atom/atom.h"
+#include "lv2/urid/urid.h"
+
+#include "amp-kernels.hpp"
+
+/**
+   Decimated scope feed for UIs.
+
+   A UI gets one summary (min, max and RMS) per `decimation` samples of the
+   output instead of the audio itself: 12 bytes per 256 samples, 1.2% of the
+   audio bandwidth, by default.  `scope_feed()` computes them in the pass
+   over the output that the level meter makes anyway, and returns the
+   block's peak for the meter.  Windows run across block boundaries.
+
+   Summaries go through a preallocated single-producer, single-consumer
+   ring.  When the host's notify buffer is too small for a burst, the rest
+   waits for the next block; only when the ring is full are new summaries
+   dropped, and counted.  `scope_write()` drains the ring into the notify
+   port as one object per block:
+
+     [] a eg-julia-amp:Scope ;
+        eg-julia-amp:decimation 256 ;     # atom:Int, samples per summary
+        eg-julia-amp:dropped 0 ;          # atom:Int, since activation
+        eg-julia-amp:summaries (...) .    # atom:Vector of atom:Float, min max rms ...
+
+   Neither allocates.
+*/
+typedef struct {
+    float min;
+    float max;
+    float rms;
+} ScopeSummary;
+
+typedef struct {
+    LV2_URID atom_Float;
+    LV2_URID atom_Int;
+    LV2_URID atom_Object;
+    LV2_URID atom_Sequence;
+    LV2_URID atom_Vector;
+    LV2_URID Scope;
+    LV2_URID decimation;
+    LV2_URID dropped;
+    LV2_URID summaries;
+} ScopeURIDs;
+
+/** Summaries in the ring, a power of two, 12 KiB. */
+#define SCOPE_RING 1024
+
+#define SCOPE_MIN_DECIMATION 16
+#define SCOPE_MAX_DECIMATION 65536
+
+typedef struct {
+    ScopeSummary*         ring;  // SCOPE_RING slots, NULL if the feed is disabled
+    std::atomic<uint32_t> head;  // Summaries written, only the producer stores
+    std::atomic<uint32_t> tail;  // Summaries read, only the consumer stores
+    uint32_t              dropped;
+
+    // Current window
+    uint32_t decimation;
+    uint32_t fill;  // Samples so far
+    float    min;
+    float    max;
+    float    sumsq;
+
+    ScopeURIDs uris;
+} Scope;
+
+static inline void
+scope_reset(Scope* scope)
+{
+    scope->head.store(0, std::memory_order_relaxed);
+    scope->tail.store(0, std::memory_order_relaxed);
+    scope->dropped = 0;
+    scope->fill    = 0;
+    scope->min     = INFINITY;
+    scope->max     = -INFINITY;
+    scope->sumsq   = 0.0f;
+}
+
+static inline bool
+scope_init(Scope* scope, uint32_t decimation, const LV2_URID_Map* map, const char* plugin_uri)
+{
+    char uri[256];
+#define SCOPE_MAP(field, name)                                     \
+    snprintf(uri, sizeof(uri), "%s#%s", plugin_uri, name);         \
+    scope->uris.field = map->map(map->handle, uri)
+
+    scope->uris.atom_Float    = map->map(map->handle, LV2_ATOM__Float);
+    scope->uris.atom_Int      = map->map(map->handle, LV2_ATOM__Int);
+    scope->uris.atom_Object   = map->map(map->handle, LV2_ATOM__Object);
+    scope->uris.atom_Sequence = map->map(map->handle, LV2_ATOM__Sequence);
+    scope->uris.atom_Vector   = map->map(map->handle, LV2_ATOM__Vector);
+    SCOPE_MAP(Scope, "Scope");
+    SCOPE_MAP(decimation, "decimation");
+    SCOPE_MAP(dropped, "dropped");
+    SCOPE_MAP(summaries, "summaries");
+#undef SCOPE_MAP
+
+    scope->decimation = std::min(std::max(decimation, (uint32_t)SCOPE_MIN_DECIMATION),
+                                 (uint32_t)SCOPE_MAX_DECIMATION);
+    scope->ring       = (ScopeSummary*)calloc(SCOPE_RING, sizeof(ScopeSummary));
+    scope_reset(scope);
+    return scope->ring != NULL;
+}
+
+static inline void
+scope_free(Scope* scope)
+{
+    free(scope->ring);
+    scope->ring = NULL;
+}
+
+/** Min, max and sum of squares of x[0..n), NaN is skipped by min and max. */
+static inline void
+scope_segment(const float* x, uint32_t n, float* min, float* max, float* sumsq)
+{
+    v4f      lo  = {INFINITY, INFINITY, INFINITY, INFINITY};
+    v4f      hi  = -lo;
+    v4f      sq  = {0.0f, 0.0f, 0.0f, 0.0f};
+    uint32_t pos = 0;
+    for (; pos + 4 <= n; pos += 4) {
+        const v4f v = v4f_load(x + pos);
+        lo          = v < lo ? v : lo;
+        hi          = v > hi ? v : hi;
+        sq         += v * v;
+    }
+    float l = std::min(std::min(lo[0], lo[1]), std::min(lo[2], lo[3]));
+    float h = std::max(std::max(hi[0], hi[1]), std::max(hi[2], hi[3]));
+    float s = (sq[0] + sq[1]) + (sq[2] + sq[3]);
+    for (; pos < n; pos++) {
+        l  = x[pos] < l ? x[pos] : l;
+        h  = x[pos] > h ? x[pos] : h;
+        s += x[pos] * x[pos];
+    }
+    *min   = l;
+    *max   = h;
+    *sumsq = s;
+}
+
+static inline void
+scope_push(Scope* scope, const ScopeSummary* summary)
+{
+    const uint32_t head = scope->head.load(std::memory_order_relaxed);
+    if (head - scope->tail.load(std::memory_order_acquire) == SCOPE_RING) {
+        ++scope->dropped;
+        return;
+    }
+    scope->ring[head & (SCOPE_RING - 1)] = *summary;
+    scope->head.store(head + 1, std::memory_order_release);
+}
+
+/** Summarizes `n` samples of the output, returns their peak magnitude. */
+static inline float
+scope_feed(Scope* scope, const float* x, uint32_t n)
+{
+    float peak = 0.0f;
+    for (uint32_t pos = 0; pos < n;) {
+        const uint32_t len = std::min(n - pos, scope->decimation - scope->fill);
+        float          min, max, sumsq;
+        scope_segment(x + pos, len, &min, &max, &sumsq);
+        peak          = std::max(peak, std::max(-min, max));
+        scope->min    = std::min(scope->min, min);
+        scope->max    = std::max(scope->max, max);
+        scope->sumsq += sumsq;
+        scope->fill  += len;
+        pos          += len;
+
+        if (scope->fill == scope->decimation) {
+            const float        rms     = sqrtf(scope->sumsq / (float)scope->decimation);
+            const ScopeSummary summary = {is_finite(scope->min) ? scope->min : 0.0f,
+                                          is_finite(scope->max) ? scope->max : 0.0f,
+                                          is_finite(rms) ? rms : 0.0f};
+            scope_push(scope, &summary);
+            scope->fill  = 0;
+            scope->min   = INFINITY;
+            scope->max   = -INFINITY;
+            scope->sumsq = 0.0f;
+        }
+    }
+    return peak;
+}
+
+/** Appends an integer property to an object body, returns the end. */
+static inline uint8_t*
+scope_int_property(uint8_t* p, LV2_URID key, LV2_URID atom_Int, int32_t value)
+{
+    LV2_Atom_Property_Body* prop = (LV2_Atom_Property_Body*)p;
+    prop->key                    = key;
+    prop->context                = 0;
+    prop->value.type             = atom_Int;
+    prop->value.size             = sizeof(int32_t);
+    memset(prop + 1, 0, lv2_atom_pad_size(sizeof(int32_t)));
+    memcpy(prop + 1, &value, sizeof(int32_t));
+    return p + sizeof(LV2_Atom_Property_Body) + lv2_atom_pad_size(sizeof(int32_t));
+}
+
+/**
+   Writes the waiting summaries into `seq`, an output sequence whose size is
+   its capacity, as one event at frame 0.  Summaries that do not fit stay in
+   the ring.  With none waiting, or no feed at all (`ring` is NULL), the
+   sequence is left empty, since the host reads it back either way.
+*/
+static inline void
+scope_write(Scope* scope, LV2_Atom_Sequence* seq)
+{
+    const ScopeURIDs* uris     = &scope->uris;
+    const uint32_t    capacity = seq->atom.size;
+    seq->atom.type             = uris->atom_Sequence;
+    seq->atom.size             = sizeof(LV2_Atom_Sequence_Body);
+    seq->body.unit             = 0;
+    seq->body.pad              = 0;
+
+    // Everything but the summaries: the event, the object and its properties
+    const uint32_t fixed = sizeof(LV2_Atom_Sequence_Body) + sizeof(LV2_Atom_Event) +
+                           sizeof(LV2_Atom_Object_Body) +
+                           2 * (sizeof(LV2_Atom_Property_Body) + lv2_atom_pad_size(sizeof(int32_t))) +
+                           sizeof(LV2_Atom_Property_Body) + sizeof(LV2_Atom_Vector_Body);
+    const uint32_t tail    = scope->tail.load(std::memory_order_relaxed);
+    const uint32_t waiting = scope->head.load(std::memory_order_acquire) - tail;
+    if (!waiting || capacity < fixed + lv2_atom_pad_size(sizeof(ScopeSummary))) {
+        return;
+    }
+    uint32_t count = std::min(waiting, (uint32_t)((capacity - fixed) / sizeof(ScopeSummary)));
+    if (fixed + lv2_atom_pad_size(count * sizeof(ScopeSummary)) > capacity) {
+        --count;
+    }
+
+    LV2_Atom_Event* ev          = (LV2_Atom_Event*)(seq + 1);
+    ev->time.frames             = 0;
+    ev->body.type               = uris->atom_Object;
+    LV2_Atom_Object_Body* obj   = (LV2_Atom_Object_Body*)(ev + 1);
+    obj->id                     = 0;
+    obj->otype                  = uris->Scope;
+
+    uint8_t* p = (uint8_t*)(obj + 1);
+    p          = scope_int_property(p, uris->decimation, uris->atom_Int, (int32_t)scope->decimation);
+    p          = scope_int_property(p, uris->dropped, uris->atom_Int, (int32_t)scope->dropped);
+
+    const uint32_t          bytes = count * sizeof(ScopeSummary);
+    LV2_Atom_Property_Body* prop  = (LV2_Atom_Property_Body*)p;
+    prop->key                     = uris->summaries;
+    prop->context                 = 0;
+    prop->value.type              = uris->atom_Vector;
+    prop->value.size              = sizeof(LV2_Atom_Vector_Body) + bytes;
+    LV2_Atom_Vector_Body* vec     = (LV2_Atom_Vector_Body*)(prop + 1);
+    vec->child_size               = sizeof(float);
+    vec->child_type               = uris->atom_Float;
+
+    // The waiting summaries may wrap around the end of the ring
+    uint8_t*       data  = (uint8_t*)(vec + 1);
+    const uint32_t first = tail & (SCOPE_RING - 1);
+    const uint32_t n1    = std::min(count, SCOPE_RING - first);
+    memcpy(data, scope->ring + first, n1 * sizeof(ScopeSummary));
+    memcpy(data + n1 * sizeof(ScopeSummary), scope->ring, (count - n1) * sizeof(ScopeSummary));
+    memset(data + bytes, 0, lv2_atom_pad_size(bytes) - bytes);
+    p = data + lv2_atom_pad_size(bytes);
+
+    ev->body.size   = (uint32_t)(p - (uint8_t*)obj);
+    seq->atom.size += sizeof(LV2_Atom_Event) + lv2_atom_pad_size(ev->body.size);
+    scope->tail.store(tail + count, std::memory_order_release);
+}
+
+#endif  // AMP_SCOPE_HPP
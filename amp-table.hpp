@@ -0,0 +1,316 @@
+#ifndef AMP_TABLE_HPP
+#define AMP_TABLE_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+/**
+   Precomputed tables shared between processes.
+
+   Hosts that sandbox every plugin in its own process would otherwise build
+   the same tables from Julia in each of them and keep a private copy.  A
+   shared table lives in a POSIX shared memory segment named after a hash of
+   everything it depends on: the script's contents and the table's
+   parameters.  The first process to create the segment builds and publishes
+   it, and the others map it read-only and wait for its `ready` flag.  The
+   builder holds a `flock` on the segment until then, so a builder that dies
+   half way is told from a slow one by its released lock; its segment is
+   unlinked and built again.  A live builder is waited for up to
+   `SHARED_TABLE_WAIT_MS`, then the table is built privately, as it is if
+   shared memory is unavailable.
+
+   Segments are created 0600 with the user's id in their name, and one that
+   belongs to anyone else is never mapped: its values would go straight into
+   the audio.
+
+   Segments outlive the processes like any file in /dev/shm.  Editing the
+   script changes the hash, so a stale table is never used, but old segments
+   stay until a reboot or `rm /dev/shm/julia-amp-*`.
+*/
+
+#define SHARED_TABLE_MAGIC   0x544D414Au  // "JAMT"
+#define SHARED_TABLE_HEADER  64           // Bytes before the values
+#define SHARED_TABLE_WAIT_MS 60000  // For a live builder, which may be compiling
+#define SHARED_TABLE_SIZE_MS 1000   // Between creating a segment and locking it
+
+/** Start of the segment, written by the builder before `ready`. */
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    float    lo;     // x of the first value
+    float    step;   // x between values
+    uint32_t ready;  // 1 once everything is written, accessed atomically
+} SharedTableHeader;
+
+/** A read-only mapping of `count` values of f(x), for x from `lo` in `step`s. */
+typedef struct {
+    const float* values;
+    uint32_t     count;
+    float        lo;
+    float        inv_step;
+    void*        map;
+    size_t       map_size;
+    bool         shared;  // False for a private copy
+    bool         built;   // False if mapped from another process
+} SharedTable;
+
+/** Fills `values[i]` with f(lo + i * step), returns false on failure. */
+typedef bool (*SharedTableBuild)(float* values, uint32_t count, float lo, float step, void* data);
+
+static inline uint64_t
+fnv1a(uint64_t hash, const void* data, size_t len)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+/** Hashes the contents of the file at `path`, returns false if it is unreadable. */
+static inline bool
+hash_file(const char* path, uint64_t* hash)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    char   buf[4096];
+    size_t len;
+    *hash = 0xCBF29CE484222325ull;
+    while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        *hash = fnv1a(*hash, buf, len);
+    }
+    fclose(file);
+    return true;
+}
+
+static inline void
+shared_table_close(SharedTable* table)
+{
+    if (table->map) {
+        munmap(table->map, table->map_size);
+    }
+    memset(table, 0, sizeof(SharedTable));
+}
+
+/** Builds into a fresh mapping and publishes it; `map` is writable here. */
+static inline bool
+shared_table_build(SharedTable* table, void* map, size_t size, uint32_t count, float lo, float step,
+                   SharedTableBuild build, void* data)
+{
+    SharedTableHeader* header = (SharedTableHeader*)map;
+    float*             values = (float*)((char*)map + SHARED_TABLE_HEADER);
+    if (!build(values, count, lo, step, data)) {
+        return false;
+    }
+    header->magic = SHARED_TABLE_MAGIC;
+    header->count = count;
+    header->lo    = lo;
+    header->step  = step;
+    __atomic_store_n(&header->ready, 1u, __ATOMIC_RELEASE);
+    mprotect(map, size, PROT_READ);
+
+    table->values   = values;
+    table->count    = count;
+    table->lo       = lo;
+    table->inv_step = 1.0f / step;
+    table->map      = map;
+    table->map_size = size;
+    table->built    = true;
+    return true;
+}
+
+typedef enum {
+    SHARED_TABLE_ATTACHED,
+    SHARED_TABLE_STALE,  // Its builder died before publishing it
+    SHARED_TABLE_BUSY    // Not usable now: still building, foreign or malformed
+} SharedTableAttach;
+
+/** Whether the builder of the segment behind `fd` still holds its lock. */
+static inline bool
+shared_table_building(int fd)
+{
+    if (flock(fd, LOCK_SH | LOCK_NB)) {
+        return errno == EWOULDBLOCK;
+    }
+    flock(fd, LOCK_UN);
+    return false;
+}
+
+/** Maps a segment another process created, once it is complete. */
+static inline SharedTableAttach
+shared_table_attach(SharedTable* table, int fd, size_t size, uint32_t count, float lo, float step)
+{
+    typedef std::chrono::steady_clock clock;
+
+    const clock::time_point start    = clock::now();
+    const clock::time_point deadline = start + std::chrono::milliseconds(SHARED_TABLE_WAIT_MS);
+
+    // Another user can create the same name; its values must never be used
+    struct stat st;
+    if (fstat(fd, &st) || st.st_uid != geteuid() || (st.st_mode & 077)) {
+        return SHARED_TABLE_BUSY;
+    }
+
+    // The builder creates the segment, then locks it, then sizes it
+    while (!fstat(fd, &st) && (size_t)st.st_size < size) {
+        if (clock::now() - start > std::chrono::milliseconds(SHARED_TABLE_SIZE_MS) &&
+            !shared_table_building(fd)) {
+            return SHARED_TABLE_STALE;
+        } else if (clock::now() > deadline) {
+            return SHARED_TABLE_BUSY;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return SHARED_TABLE_BUSY;
+    }
+    const SharedTableHeader* header = (const SharedTableHeader*)map;
+    while (!__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE)) {
+        // Checking `ready` again after the lock rules out a builder that
+        // published and left in between
+        const bool building = shared_table_building(fd);
+        if (!building && !__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE)) {
+            munmap(map, size);
+            return SHARED_TABLE_STALE;
+        } else if (building && clock::now() > deadline) {
+            munmap(map, size);
+            return SHARED_TABLE_BUSY;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (header->magic != SHARED_TABLE_MAGIC || header->count != count || header->lo != lo ||
+        header->step != step) {
+        munmap(map, size);
+        return SHARED_TABLE_BUSY;
+    }
+
+    table->values   = (const float*)((const char*)map + SHARED_TABLE_HEADER);
+    table->count    = count;
+    table->lo       = lo;
+    table->inv_step = 1.0f / step;
+    table->map      = map;
+    table->map_size = size;
+    table->shared   = true;
+    return SHARED_TABLE_ATTACHED;
+}
+
+/**
+   Opens the table `name` of `count` values from `lo` in `step`s, for a
+   script with content hash `key`.  Maps the shared copy if one exists,
+   otherwise builds it with `build` and shares it.
+*/
+static inline bool
+shared_table_open(SharedTable*     table,
+                  const char*      name,
+                  uint64_t         key,
+                  uint32_t         count,
+                  float            lo,
+                  float            step,
+                  SharedTableBuild build,
+                  void*            data)
+{
+    memset(table, 0, sizeof(SharedTable));
+    if (count < 2) {
+        return false;
+    }
+
+    const size_t size = SHARED_TABLE_HEADER + count * sizeof(float);
+    key               = fnv1a(key, &count, sizeof(count));
+    key               = fnv1a(key, &lo, sizeof(lo));
+    key               = fnv1a(key, &step, sizeof(step));
+
+    char shm_name[128];
+    snprintf(shm_name, sizeof(shm_name), "/julia-amp-%u-%s-%016llx", (unsigned)geteuid(), name,
+             (unsigned long long)key);
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            // Held until the table is published, or the builder dies
+            flock(fd, LOCK_EX);
+            void* map = ftruncate(fd, size) ? MAP_FAILED
+                                            : mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                                   MAP_SHARED, fd, 0);
+            const bool built = map != MAP_FAILED &&
+                               shared_table_build(table, map, size, count, lo, step, build, data);
+            if (built) {
+                table->shared = true;
+            } else {
+                if (map != MAP_FAILED) {
+                    munmap(map, size);
+                }
+                shm_unlink(shm_name);  // Nobody must wait for a table that never comes
+            }
+            close(fd);
+            return built;
+        } else if (errno != EEXIST) {
+            break;  // No usable /dev/shm
+        }
+
+        fd = shm_open(shm_name, O_RDONLY, 0);
+        if (fd < 0) {
+            continue;  // Unlinked in the meantime
+        }
+        const SharedTableAttach attached = shared_table_attach(table, fd, size, count, lo, step);
+        close(fd);
+        if (attached == SHARED_TABLE_ATTACHED) {
+            return true;
+        } else if (attached == SHARED_TABLE_BUSY) {
+            break;
+        }
+        fprintf(stderr, "julia-amp: rebuilding stale table %s\n", shm_name);
+        shm_unlink(shm_name);
+    }
+
+    // Private copy
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    if (!shared_table_build(table, map, size, count, lo, step, build, data)) {
+        munmap(map, size);
+        return false;
+    }
+    return true;
+}
+
+/** f(x) by linear interpolation, clamped to the ends of the table. */
+static inline float
+shared_table_lookup(const SharedTable* table, float x)
+{
+    float pos = (x - table->lo) * table->inv_step;
+    pos       = pos > 0.0f ? pos : 0.0f;  // Also maps NaN to the first value
+    const uint32_t i = (uint32_t)std::min(pos, (float)(table->count - 1));
+    if (i >= table->count - 1) {
+        return table->values[table->count - 1];
+    }
+    const float frac = pos - (float)i;
+    return table->values[i] + frac * (table->values[i + 1] - table->values[i]);
+}
+
+/** out[i] = f(offset + x[i]) */
+static inline void
+shared_table_lookup_block(const SharedTable* table, float* out, float offset, const float* x, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i) {
+        out[i] = shared_table_lookup(table, offset + x[i]);
+    }
+}
+
+#endif  // AMP_TABLE_HPP
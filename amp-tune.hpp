@@ -0,0 +1,211 @@
+#ifndef AMP_TUNE_HPP
+#define AMP_TUNE_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "amp-kernels.hpp"
+
+/**
+   Kernel autotuning.
+
+   The candidates in `gain_kernels` are timed on a block of the host's length
+   and the fastest one is remembered in `tune.cache` in the bundle, one line
+   per CPU model, block length and variant (`sanitized` or `plain`, after
+   JULIA_AMP_SANITIZE, since the two are timed separately):
+
+       <cpu model>|<block length>|<variant>|<kernel name>
+
+   so only the first instantiation on a given machine pays for the benchmark.
+   JULIA_AMP_KERNEL=<name> skips tuning and forces a kernel, which is useful
+   when debugging a particular implementation.  With JULIA_AMP_JULIA_KERNEL=1
+   blocks are processed by a Julia `process!` specialization instead, and the
+   kernel selected here is only used while Julia is latched or degraded.
+*/
+
+#define AMP_TUNE_CACHE "tune.cache"
+
+static inline void
+cpu_model(char* buf, size_t len)
+{
+    snprintf(buf, len, "unknown");
+
+    FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (!cpuinfo) {
+        return;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), cpuinfo)) {
+        // "model name" on x86, "CPU part" is the closest thing on ARM
+        if (!strncmp(line, "model name", 10) || !strncmp(line, "CPU part", 8)) {
+            const char* value = strchr(line, ':');
+            if (value) {
+                value += strspn(value, ": \t");
+                snprintf(buf, len, "%.*s", (int)strcspn(value, "\n"), value);
+                // The cache is '|'-separated
+                for (char* c = buf; *c; ++c) {
+                    if (*c == '|') {
+                        *c = '/';
+                    }
+                }
+            }
+            break;
+        }
+    }
+    fclose(cpuinfo);
+}
+
+/** The variant of the kernels that is timed, and so the cache entry it belongs to. */
+static inline const char*
+tune_variant(bool sanitize)
+{
+    return sanitize ? "sanitized" : "plain";
+}
+
+static inline const GainKernelInfo*
+tune_cache_lookup(const char* bundle_path, const char* cpu, uint32_t block_length, bool sanitize)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/" AMP_TUNE_CACHE, bundle_path);
+
+    FILE* cache = fopen(path, "r");
+    if (!cache) {
+        return NULL;
+    }
+
+    const GainKernelInfo* kernel = NULL;
+    char                  line[512];
+    while (fgets(line, sizeof(line), cache)) {
+        char* block   = strchr(line, '|');
+        char* variant = block ? strchr(block + 1, '|') : NULL;
+        char* name    = variant ? strchr(variant + 1, '|') : NULL;
+        if (!name) {
+            continue;  // Also skips lines from before variants were recorded
+        }
+        *block++   = '\0';
+        *variant++ = '\0';
+        *name++    = '\0';
+        name[strcspn(name, "\n")] = '\0';
+        if (!strcmp(line, cpu) && (uint32_t)strtoul(block, NULL, 10) == block_length &&
+            !strcmp(variant, tune_variant(sanitize))) {
+            kernel = find_gain_kernel(name);  // Last entry wins
+        }
+    }
+    fclose(cache);
+    return kernel;
+}
+
+static inline void
+tune_cache_store(const char* bundle_path,
+                 const char* cpu,
+                 uint32_t    block_length,
+                 bool        sanitize,
+                 const char* name)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/" AMP_TUNE_CACHE, bundle_path);
+
+    // Bundles are often installed read-only, in which case we tune every time
+    FILE* cache = fopen(path, "a");
+    if (cache) {
+        fprintf(cache, "%s|%u|%s|%s\n", cpu, block_length, tune_variant(sanitize), name);
+        fclose(cache);
+    }
+}
+
+/**
+   Returns the median time in nanoseconds of one call of `kernel` on a block
+   of `n` samples.  Each measurement covers several calls so the clock
+   resolution does not dominate small blocks.
+*/
+static inline double
+time_gain_kernel(GainKernel kernel, float* out, const float* in, uint32_t n)
+{
+    typedef std::chrono::steady_clock clock;
+
+    const uint32_t calls = 1 + 65536 / (n ? n : 1);
+    double         samples[15];
+
+    kernel(out, in, 0.5f, n);  // Warm caches and page in the buffers
+    for (double& t : samples) {
+        const clock::time_point start = clock::now();
+        for (uint32_t i = 0; i < calls; ++i) {
+            kernel(out, in, 0.5f, n);
+        }
+        t = std::chrono::duration<double, std::nano>(clock::now() - start).count() / calls;
+    }
+
+    for (int i = 1; i < 15; ++i) {  // Insertion sort, there are only 15
+        for (int j = i; j > 0 && samples[j] < samples[j - 1]; --j) {
+            const double tmp = samples[j];
+            samples[j]       = samples[j - 1];
+            samples[j - 1]   = tmp;
+        }
+    }
+    return samples[7];
+}
+
+static inline const GainKernelInfo*
+tune_gain_kernel(uint32_t block_length, bool sanitize)
+{
+    float* in  = (float*)calloc(block_length + 1, sizeof(float));
+    float* out = (float*)calloc(block_length + 1, sizeof(float));
+    if (!in || !out) {
+        free(in);
+        free(out);
+        return &gain_kernels[0];
+    }
+    for (uint32_t i = 0; i < block_length; ++i) {
+        in[i] = (float)i / (float)block_length - 0.5f;
+    }
+
+    const GainKernelInfo* best      = &gain_kernels[0];
+    double                best_time = 0.0;
+    for (uint32_t k = 0; k < n_gain_kernels; ++k) {
+        const GainKernel kernel = sanitize ? gain_kernels[k].sanitized : gain_kernels[k].plain;
+        const double     t      = time_gain_kernel(kernel, out, in, block_length);
+        if (k == 0 || t < best_time) {
+            best      = &gain_kernels[k];
+            best_time = t;
+        }
+    }
+
+    free(in);
+    free(out);
+    return best;
+}
+
+/**
+   Selects the gain kernel for this machine and block length: the forced
+   kernel if JULIA_AMP_KERNEL is set, else the cached winner, else the winner
+   of a fresh benchmark (which is then cached).
+*/
+static inline const GainKernelInfo*
+select_gain_kernel(const char* bundle_path, uint32_t block_length, bool sanitize)
+{
+    const char* forced = getenv("JULIA_AMP_KERNEL");
+    if (forced) {
+        const GainKernelInfo* kernel = find_gain_kernel(forced);
+        if (kernel) {
+            return kernel;
+        }
+        fprintf(stderr, "julia-amp: unknown kernel '%s', tuning instead\n", forced);
+    }
+
+    char cpu[128];
+    cpu_model(cpu, sizeof(cpu));
+
+    const GainKernelInfo* kernel = tune_cache_lookup(bundle_path, cpu, block_length, sanitize);
+    if (!kernel) {
+        kernel = tune_gain_kernel(block_length, sanitize);
+        tune_cache_store(bundle_path, cpu, block_length, sanitize, kernel->name);
+    }
+    return kernel;
+}
+
+#endif  // AMP_TUNE_HPP
@@ -0,0 +1,93 @@
+#ifndef AMP_WATCHDOG_HPP
+#define AMP_WATCHDOG_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+/**
+   Latency watchdog.
+
+   Every block's processing time is recorded as a fraction of the block's
+   period (its length over the sample rate), the load.  Every
+   `WATCHDOG_CHECK` blocks, the 99th percentile over the last
+   `WATCHDOG_HISTORY` blocks is compared with the budget:
+
+   - Above the budget, the caller should step down to a cheaper mode.
+   - Below `WATCHDOG_HEADROOM` times the budget for `patience` checks in a
+     row, it may step back up.
+
+   After any step the history is cleared, so each decision only looks at
+   blocks processed in the current mode.  Each step down doubles the
+   patience (up to `WATCHDOG_MAX_PATIENCE`), so a mode that only just fits
+   is not retried over and over.  `watchdog_update()` is real-time safe.
+*/
+
+#define WATCHDOG_HISTORY      128  // Blocks in the rolling window, the p99 is the second worst
+#define WATCHDOG_CHECK        32   // Blocks between decisions
+#define WATCHDOG_HEADROOM     0.5f
+#define WATCHDOG_PATIENCE     4    // Healthy checks before the first step up
+#define WATCHDOG_MAX_PATIENCE 64
+
+typedef struct {
+    float    budget;  // Fraction of the block period, 0 disables the watchdog
+    float    load[WATCHDOG_HISTORY];
+    uint32_t pos;
+    uint32_t count;     // Blocks recorded since the last step, up to the history
+    uint32_t healthy;   // Checks in a row with headroom
+    uint32_t patience;  // Healthy checks needed to step up
+    float    p99;       // At the last check
+} Watchdog;
+
+static inline void
+watchdog_reset(Watchdog* wd, float budget)
+{
+    memset(wd, 0, sizeof(Watchdog));
+    wd->budget   = budget;
+    wd->patience = WATCHDOG_PATIENCE;
+}
+
+/** Forgets the history, after the caller changed modes. */
+static inline void
+watchdog_stepped(Watchdog* wd, int step)
+{
+    wd->pos     = 0;
+    wd->count   = 0;
+    wd->healthy = 0;
+    if (step < 0) {
+        wd->patience = std::min(wd->patience * 2, (uint32_t)WATCHDOG_MAX_PATIENCE);
+    }
+}
+
+/**
+   Records a block that took `seconds` out of its `period`.  Returns -1 to
+   step down, 1 to step up, and 0 to stay.
+*/
+static inline int
+watchdog_update(Watchdog* wd, double seconds, double period)
+{
+    wd->load[wd->pos] = (float)(seconds / period);
+    wd->pos           = wd->pos + 1 == WATCHDOG_HISTORY ? 0 : wd->pos + 1;
+    if (++wd->count < WATCHDOG_HISTORY || wd->count % WATCHDOG_CHECK) {
+        return 0;
+    }
+    wd->count = WATCHDOG_HISTORY;
+
+    float sorted[WATCHDOG_HISTORY];
+    memcpy(sorted, wd->load, sizeof(sorted));
+    const uint32_t rank = WATCHDOG_HISTORY - 1 - WATCHDOG_HISTORY / 100;
+    std::nth_element(sorted, sorted + rank, sorted + WATCHDOG_HISTORY);
+    wd->p99 = sorted[rank];
+
+    if (wd->p99 > wd->budget) {
+        return -1;
+    } else if (wd->p99 < WATCHDOG_HEADROOM * wd->budget && ++wd->healthy >= wd->patience) {
+        return 1;
+    } else if (wd->p99 >= WATCHDOG_HEADROOM * wd->budget) {
+        wd->healthy = 0;
+    }
+    return 0;
+}
+
+#endif  // AMP_WATCHDOG_HPP
@@ -1,8 +1,284 @@
 module julia_amp
 
+import InteractiveUtils
+
 function db_to_coef(gain)
     coef = gain < 9.0f0 ? exp10(-0.05f0 * gain) : 0.0f0
     return coef
 end
 
+# Block kernels
+#
+# `process!` applies the gain to a whole block.  The static configuration
+# (channel count, block length, feature flags) is passed as `Val` type
+# parameters, so every configuration gets its own compiled specialization
+# with constant trip counts and dead feature branches removed.
+
+# Mirrors `JuliaBlock` in julia-amp.cpp
+struct Block
+    out::Ptr{Float32}
+    in::Ptr{Float32}
+    n::UInt32
+    gain::Float32
+end
+
+const FLAG_SANITIZE = UInt32(1)
+
+@inline function store!(out::Ptr{Float32}, in::Ptr{Float32}, coef::Float32, i, ::Val{F}) where {F}
+    y = unsafe_load(in, i) * coef
+    if F & FLAG_SANITIZE != 0
+        y = ifelse(isfinite(y), y, 0.0f0)
+    end
+    unsafe_store!(out, y, i)
+end
+
+function process!(b::Block, ::Val{C}, ::Val{N}, flags::Val{F}) where {C,N,F}
+    coef = Float32(db_to_coef(b.gain))
+    if N > 0 && b.n == N
+        @inbounds @simd for i in 1:C*N
+            store!(b.out, b.in, coef, i, flags)
+        end
+    else
+        @inbounds @simd for i in 1:C*Int(b.n)
+            store!(b.out, b.in, coef, i, flags)
+        end
+    end
+    return coef
+end
+
+"""
+    coefs!(block)
+
+Gain law for the points of a control signal: `out[i] = db_to_coef(gain + in[i])`.
+The plugin calls this once per block with the control points of the gain CV
+(one every `JULIA_AMP_CONTROL_RATE` samples) and interpolates the results.
+Returns the coefficient for `gain` alone.
+"""
+function coefs!(block::Ptr{Cvoid})
+    b = unsafe_load(Ptr{Block}(block))
+    @inbounds for i in 1:Int(b.n)
+        unsafe_store!(b.out, Float32(db_to_coef(b.gain + unsafe_load(b.in, i))), i)
+    end
+    return Float32(db_to_coef(b.gain))
+end
+
+"""
+    compressor_gain(level)
+
+Static curve of the compressor: the gain change in dB for an input level in
+dB.  This one is a 4:1 compressor over -18 dB with a 6 dB soft knee, the
+same as the default port values.
+"""
+function compressor_gain(level)
+    threshold, ratio, knee = -18.0f0, 4.0f0, 6.0f0
+    d = level - threshold
+    if 2d <= -knee
+        return 0.0f0
+    elseif 2d < knee
+        return (1 / ratio - 1) * (d + knee / 2)^2 / (2knee)
+    else
+        return (1 / ratio - 1) * d
+    end
+end
+
+"""
+    curve!(block)
+
+Samples `compressor_gain` at the levels in `in`, for
+JULIA_AMP_COMPRESSOR_CURVE=julia.  The plugin calls this once at activation
+and interpolates between the points.
+"""
+function curve!(block::Ptr{Cvoid})
+    b = unsafe_load(Ptr{Block}(block))
+    @inbounds for i in 1:Int(b.n)
+        unsafe_store!(b.out, Float32(compressor_gain(unsafe_load(b.in, i))), i)
+    end
+    return 0.0f0
+end
+
+struct Kernel{C,N,F} end
+
+(::Kernel{C,N,F})(block::Ptr{Cvoid}) where {C,N,F} =
+    process!(unsafe_load(Ptr{Block}(block)), Val(C), Val(N), Val(F))
+
+# Compiled specializations, keyed by (channels, block length, flags).  Julia
+# never frees compiled code, so rather than evicting, configurations beyond
+# MAX_VARIANTS share the generic (N = 0) kernel for their channels and flags.
+# The plugin includes this file once per process for each version of it, so
+# the cache is shared by every instance and activation running that version.
+const MAX_VARIANTS = 8
+const VARIANTS = Dict{Tuple{Int,Int,UInt32},Any}()
+
+function compile(channels, block, flags)
+    kernel = Kernel{channels,block,flags}()
+    precompile(kernel, (Ptr{Cvoid},))
+    return kernel
+end
+
+function variant(channels::Integer, block::Integer, flags::Integer)
+    key = (Int(channels), Int(block), UInt32(flags))
+    get(VARIANTS, key) do
+        if length(VARIANTS) >= MAX_VARIANTS
+            generic = (key[1], 0, key[3])
+            return get!(() -> compile(generic...), VARIANTS, generic)
+        end
+        VARIANTS[key] = compile(key...)
+    end
+end
+
+# Vectorization report
+#
+# After compiling a kernel, the plugin (or the engine) calls `report!` to see
+# what it compiled to on this CPU.  The optimized LLVM IR of the `process!`
+# specialization gives the widest Float32 vector, whether the loop vectorizer
+# ran (it names the vector loop `vector.body`), and the bounds checks left.
+
+# Mirrors `JuliaAmpKernelReport` in julia-amp.h
+struct Report
+    width::Int32
+    vectorized::Int32
+    boundschecks::Int32
+    refused::Int32
+end
+
+function report!(report::Ptr{Cvoid}, ::Kernel{C,N,F}) where {C,N,F}
+    ir = sprint(io -> InteractiveUtils.code_llvm(io, process!, Tuple{Block,Val{C},Val{N},Val{F}};
+                                                  debuginfo = :none))
+    widths = [parse(Int32, m[1]) for m in eachmatch(r"<(\d+) x float>", ir)]
+    unsafe_store!(Ptr{Report}(report),
+                  Report(isempty(widths) ? 1 : maximum(widths), occursin("vector.body", ir),
+                         count(r"throw_boundserror|jl_bounds_error", ir), 0))
+    return 0.0f0
+end
+
+# On-demand profiling
+#
+# When a capture is triggered (see JULIA_AMP_PROFILE_DIR in julia-amp.cpp),
+# the plugin calls `start!` on the worker thread and `stop!` some seconds
+# later.  Both profiles are written as folded stacks, one
+# `root;...;leaf weight` line per distinct stack, which flamegraph.pl,
+# inferno and speedscope read directly.  CPU samples are weighted by count,
+# allocations by bytes.
+module Profiling
+
+using Profile
+
+function start!(alloc_rate::Real)
+    Profile.clear()
+    Profile.init(delay = 0.001)
+    Profile.start_timer()
+    if isdefined(Profile, :Allocs)
+        Profile.Allocs.clear()
+        Profile.Allocs.start(sample_rate = alloc_rate)
+    end
+    return nothing
+end
+
+frame_name(f) = string(f.func, " ", basename(string(f.file)), ":", f.line)
+
+# Frames come innermost first, flamegraphs want the root first
+folded(frames) = join((frame_name(f) for f in Iterators.reverse(frames) if !f.from_c), ';')
+
+function write_folded(path, weights)
+    open(path, "w") do io
+        for (stack, weight) in weights
+            isempty(stack) || println(io, stack, " ", weight)
+        end
+    end
+end
+
+function stop!(prefix::AbstractString)
+    Profile.stop_timer()
+    data = hasmethod(Profile.fetch, Tuple{}, (:include_meta,)) ?
+        Profile.fetch(include_meta = false) : Profile.fetch()
+    lidict = Profile.getdict(data)
+
+    # Each sample is a run of instruction pointers, innermost first, ended by 0
+    samples = Dict{String,Int}()
+    frames  = Base.StackTraces.StackFrame[]
+    for ip in data
+        if ip == 0
+            stack = folded(frames)
+            samples[stack] = get(samples, stack, 0) + 1
+            empty!(frames)
+        else
+            append!(frames, lidict[ip])
+        end
+    end
+    write_folded(prefix * ".cpu.folded", samples)
+    Profile.clear()
+
+    bytes = Dict{String,Int}()
+    if isdefined(Profile, :Allocs)
+        Profile.Allocs.stop()
+        for alloc in Profile.Allocs.fetch().allocs
+            stack = folded(alloc.stacktrace)
+            bytes[stack] = get(bytes, stack, 0) + alloc.size
+        end
+        Profile.Allocs.clear()
+    end
+    write_folded(prefix * ".alloc.folded", bytes)
+    return nothing
+end
+
+end # module Profiling
+
+# Native kernels
+#
+# The plugin binary exports a few hand-vectorized kernels with a C ABI.  The
+# plugin passes their addresses to `load!` on activation; scripts can then
+# use these on raw pointers, or on dense Float32 vectors without copying.
+# Julia never opens the binary itself, since the reference that would take
+# keeps a host from unloading the plugin.
+module Native
+
+const GAIN = Ref{Ptr{Cvoid}}(C_NULL)
+const RAMP = Ref{Ptr{Cvoid}}(C_NULL)
+const MIX  = Ref{Ptr{Cvoid}}(C_NULL)
+
+function load!(gain::Ptr{Cvoid}, ramp::Ptr{Cvoid}, mix::Ptr{Cvoid})
+    GAIN[] = gain
+    RAMP[] = ramp
+    MIX[]  = mix
+    return nothing
+end
+
+loaded() = GAIN[] != C_NULL
+
+"out[i] = in[i] * coef"
+gain!(out::Ptr{Float32}, in::Ptr{Float32}, coef::Real, n::Integer) =
+    ccall(GAIN[], Cvoid, (Ptr{Float32}, Ptr{Float32}, Float32, UInt32), out, in, coef, n)
+
+"out[i] = in[i] * g[i], with g ramping linearly from `from` to `to` over n samples"
+ramp!(out::Ptr{Float32}, in::Ptr{Float32}, from::Real, to::Real, n::Integer) =
+    ccall(RAMP[], Cvoid, (Ptr{Float32}, Ptr{Float32}, Float32, Float32, UInt32),
+          out, in, from, to, n)
+
+"out[i] = a[i] * ga + b[i] * gb"
+mix!(out::Ptr{Float32}, a::Ptr{Float32}, ga::Real, b::Ptr{Float32}, gb::Real, n::Integer) =
+    ccall(MIX[], Cvoid, (Ptr{Float32}, Ptr{Float32}, Float32, Ptr{Float32}, Float32, UInt32),
+          out, a, ga, b, gb, n)
+
+const Buffer = DenseVector{Float32}
+
+function gain!(out::Buffer, in::Buffer, coef::Real)
+    length(out) == length(in) || throw(DimensionMismatch("out and in differ in length"))
+    GC.@preserve out in gain!(pointer(out), pointer(in), coef, length(out))
+    return out
+end
+
+function ramp!(out::Buffer, in::Buffer, from::Real, to::Real)
+    length(out) == length(in) || throw(DimensionMismatch("out and in differ in length"))
+    GC.@preserve out in ramp!(pointer(out), pointer(in), from, to, length(out))
+    return out
+end
+
+function mix!(out::Buffer, a::Buffer, ga::Real, b::Buffer, gb::Real)
+    length(out) == length(a) == length(b) || throw(DimensionMismatch("buffers differ in length"))
+    GC.@preserve out a b mix!(pointer(out), pointer(a), ga, pointer(b), gb, length(out))
+    return out
+end
+
+end # module Native
+
 end
@@ -0,0 +1,636 @@
+/**
+   Kernel benchmark.
+
+   Times the gain kernels directly, without the plugin or Julia, so results
+   only reflect the code in amp-kernels.hpp.  Prints the median time per
+   block and per sample for each kernel at each block length, and the speedup
+   over the generic kernel (the first one in the registry).  The limiter is
+   timed at several lookahead windows on a signal that keeps it limiting.
+   Each stage of the compressor is timed on its own, with scalar libm
+   versions of the vectorized stages for comparison, and then as a whole.
+
+   Usage: ./bench [block length...]
+
+   Stress mode loads the plugin instead and measures how long each `run()`
+   takes while the machine is busy, since dropouts happen under load rather
+   than in clean benchmarks.  Each processing mode gets its own instance:
+
+   - `native`: the tuned native kernel, with Julia computing the coefficient
+   - `julia`:  the Julia `process!` kernel (JULIA_AMP_JULIA_KERNEL=1)
+   - `cv`:     the gain CV connected, evaluated at control rate in Julia
+
+   and is run at the real-time pace of the block length under each stressor:
+
+   - `none`:  no load, the baseline
+   - `cpu`:   two busy threads pinned to the Julia worker's CPU
+   - `mem`:   one memcpy thread per two CPUs, saturating memory bandwidth
+   - `gc`:    Julia garbage queued on the worker, forcing collections
+   - `cache`: a thread streaming a large temporary file through the page
+              cache and dropping it again, so writeback and cold reads compete
+
+   For every combination the per-block latency distribution is printed
+   (median, 99th and 99.9th percentile, maximum) with the number of blocks
+   that took longer than their real-time budget.  The Julia worker's own
+   accounting per task kind follows, from `julia_amp_worker_metrics()`.
+
+   Usage: ./bench stress [-B DIR] [-b N] [-n BLOCKS] [stressor...]
+
+     -B DIR     Bundle directory with julia-amp.so and amp.jl (.)
+     -b N       Block length (256)
+     -n BLOCKS  Blocks per mode and stressor (2000)
+*/
+
+#include "lv2/core/lv2.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "julia-amp.h"
+#include "amp-compressor.hpp"
+#include "amp-kernels.hpp"
+#include "amp-limiter.hpp"
+#include "amp-tune.hpp"
+
+static const uint32_t default_lengths[] = {32, 64, 100, 128, 256, 512, 1024};
+
+// Lookahead windows in samples: 0.33, 1.33, 5 and 20 ms at 48 kHz, and 20 ms at 192 kHz
+static const uint32_t limiter_windows[] = {16, 64, 240, 960, 3840};
+
+static void
+bench_gain(uint32_t n)
+{
+    float* in  = (float*)calloc(n + 1, sizeof(float));
+    float* out = (float*)calloc(n + 1, sizeof(float));
+    for (uint32_t i = 0; i < n; ++i) {
+        in[i] = (float)i / (float)n - 0.5f;
+    }
+
+    const double generic = time_gain_kernel(gain_kernels[0].sanitized, out, in, n);
+    for (uint32_t k = 0; k < n_gain_kernels; ++k) {
+        const double t = time_gain_kernel(gain_kernels[k].sanitized, out, in, n);
+        printf("gain  %-8s %5u  %9.1f ns/block  %6.3f ns/sample  %5.2fx\n",
+               gain_kernels[k].name, n, t, t / n, generic / t);
+    }
+
+    free(in);
+    free(out);
+}
+
+static void
+bench_limiter(uint32_t n)
+{
+    typedef std::chrono::steady_clock clock;
+
+    const uint32_t total = 1 << 20;
+    float*         in    = (float*)calloc(total, sizeof(float));
+    float*         out   = (float*)calloc(total, sizeof(float));
+    uint32_t       seed  = 1;
+    for (uint32_t i = 0; i < total; ++i) {
+        seed  = seed * 1103515245u + 12345u;
+        in[i] = ((float)(seed >> 8) / (float)(1u << 24) - 0.5f) * 4.0f;
+    }
+
+    ScopedDenormals denormals;  // As in the plugin
+    Limiter         lim;
+    limiter_init(&lim, limiter_windows[sizeof(limiter_windows) / sizeof(uint32_t) - 1]);
+    for (uint32_t window : limiter_windows) {
+        limiter_reset(&lim, window, 0.5f, 0.9995f);
+        limiter_process(&lim, out, in, n);  // Warm up
+
+        const clock::time_point start = clock::now();
+        for (uint32_t offset = 0; offset + n <= total; offset += n) {
+            limiter_process(&lim, out + offset, in + offset, n);
+        }
+        const double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        printf("limit window %-5u %5u  %9.1f ns/block  %6.3f ns/sample\n",
+               window, n, ns / (total / n), ns / (total / n * n));
+    }
+
+    limiter_free(&lim);
+    free(in);
+    free(out);
+}
+
+/** Median time per sample of `stage(offset, len)` over a whole signal in blocks of `n`. */
+template <typename F>
+static double
+time_stage(uint32_t total, uint32_t n, const F& stage)
+{
+    typedef std::chrono::steady_clock clock;
+
+    double samples[5];
+    stage(0, n);  // Warm up
+    for (double& t : samples) {
+        const clock::time_point start = clock::now();
+        for (uint32_t offset = 0; offset + n <= total; offset += n) {
+            stage(offset, n);
+        }
+        t = std::chrono::duration<double, std::nano>(clock::now() - start).count() /
+            (total / n * n);
+    }
+    std::sort(samples, samples + 5);
+    return samples[2];
+}
+
+static void
+bench_compressor(uint32_t n)
+{
+    const uint32_t total  = 1 << 20;
+    float*         in     = (float*)calloc(total, sizeof(float));
+    float*         out    = (float*)calloc(total, sizeof(float));
+    float*         level  = (float*)calloc(total, sizeof(float));
+    float*         target = (float*)calloc(total, sizeof(float));
+    float*         env    = (float*)calloc(total, sizeof(float));
+    float*         gain   = (float*)calloc(total, sizeof(float));
+    uint32_t       seed   = 1;
+    for (uint32_t i = 0; i < total; ++i) {
+        // Noise under a slow swell, so the envelope keeps moving
+        seed              = seed * 1103515245u + 12345u;
+        const float swell = 0.5f + 0.5f * sinf(2.0f * (float)M_PI * (float)i / 48000.0f);
+        in[i]             = ((float)(seed >> 8) / (float)(1u << 24) - 0.5f) * 2.0f * swell;
+    }
+
+    ScopedDenormals denormals;  // As in the plugin
+    Compressor      comp;
+    memset(&comp, 0, sizeof(comp));
+    compressor_set(&comp, -18.0f, 4.0f, 6.0f, 5.0f, 100.0f, 48000.0);
+
+    const double t_level = time_stage(total, n, [&](uint32_t o, uint32_t k) {
+        compressor_level(level + o, in + o, k);
+    });
+    const double t_level_libm = time_stage(total, n, [&](uint32_t o, uint32_t k) {
+        for (uint32_t i = o; i < o + k; ++i) {
+            const float a = fabsf(in[i]);
+            level[i]      = a > 1e-6f ? 20.0f * log10f(a) : COMPRESSOR_FLOOR_DB;
+        }
+    });
+    const double t_curve = time_stage(total, n, [&](uint32_t o, uint32_t k) {
+        compressor_curve(&comp, target + o, level + o, k);
+    });
+    const double t_env = time_stage(total, n, [&](uint32_t o, uint32_t k) {
+        compressor_envelope(&comp, env + o, target + o, k);
+    });
+    const double t_gains = time_stage(total, n, [&](uint32_t o, uint32_t k) {
+        compressor_gains(gain + o, env + o, k);
+    });
+    const double t_gains_libm = time_stage(total, n, [&](uint32_t o, uint32_t k) {
+        for (uint32_t i = o; i < o + k; ++i) {
+            gain[i] = powf(10.0f, 0.05f * env[i]);
+        }
+    });
+    const double t_apply = time_stage(total, n, [&](uint32_t o, uint32_t k) {
+        apply_gains<true>(out + o, in + o, gain + o, k);
+    });
+    const double t_all = time_stage(total, n, [&](uint32_t o, uint32_t k) {
+        compressor_process<true>(&comp, out + o, in + o, k);
+    });
+
+    printf("comp  level    %5u  %6.3f ns/sample  (libm %6.3f, %5.2fx)\n",
+           n, t_level, t_level_libm, t_level_libm / t_level);
+    printf("comp  curve    %5u  %6.3f ns/sample\n", n, t_curve);
+    printf("comp  envelope %5u  %6.3f ns/sample\n", n, t_env);
+    printf("comp  gains    %5u  %6.3f ns/sample  (libm %6.3f, %5.2fx)\n",
+           n, t_gains, t_gains_libm, t_gains_libm / t_gains);
+    printf("comp  apply    %5u  %6.3f ns/sample\n", n, t_apply);
+    printf("comp  total    %5u  %6.3f ns/sample\n", n, t_all);
+
+    free(in);
+    free(out);
+    free(level);
+    free(target);
+    free(env);
+    free(gain);
+}
+
+/* Stress mode */
+
+#define STRESS_RATE 48000.0
+
+/** Size of the temporary file the `cache` stressor cycles through. */
+#define STRESS_CACHE_BYTES (1024u << 20)
+
+typedef struct {
+    void*                                lib;
+    decltype(&julia_amp_worker_eval)     worker_eval;
+    decltype(&julia_amp_worker_cpu)      worker_cpu;
+    decltype(&julia_amp_worker_metrics)  worker_metrics;
+    decltype(&julia_amp_task_kind_name)  task_kind_name;
+} PluginLibrary;
+
+typedef enum { MODE_NATIVE, MODE_JULIA, MODE_CV, N_MODES } Mode;
+
+static const char* const mode_names[] = {"native", "julia", "cv"};
+
+typedef struct {
+    const LV2_Descriptor* desc;
+    LV2_Handle            handle;
+    float                 gain;
+    std::vector<float>    in;
+    std::vector<float>    out;
+    std::vector<float>    cv;
+} Instance;
+
+typedef enum { STRESS_NONE, STRESS_CPU, STRESS_MEM, STRESS_GC, STRESS_CACHE, N_STRESSORS } Stressor;
+
+static const char* const stressor_names[] = {"none", "cpu", "mem", "gc", "cache"};
+
+typedef struct {
+    std::atomic<bool>        stop;
+    std::vector<std::thread> threads;
+} Stress;
+
+static bool
+instance_open(Instance* inst, const PluginLibrary* lib, const char* bundle, Mode mode, uint32_t n)
+{
+    typedef const LV2_Descriptor* (*DescriptorFunc)(uint32_t);
+    DescriptorFunc lv2_descriptor = (DescriptorFunc)dlsym(lib->lib, "lv2_descriptor");
+    inst->desc                    = lv2_descriptor ? lv2_descriptor(0) : NULL;
+    if (!inst->desc) {
+        return false;
+    }
+
+    // The kernel is chosen from the environment at instantiation
+    const char* forced = getenv("JULIA_AMP_JULIA_KERNEL");
+    std::string saved  = forced ? forced : "";
+    if (mode == MODE_JULIA) {
+        setenv("JULIA_AMP_JULIA_KERNEL", "1", 1);
+    } else {
+        unsetenv("JULIA_AMP_JULIA_KERNEL");
+    }
+    inst->handle = inst->desc->instantiate(inst->desc, STRESS_RATE, bundle, NULL);
+    if (forced) {
+        setenv("JULIA_AMP_JULIA_KERNEL", saved.c_str(), 1);
+    } else {
+        unsetenv("JULIA_AMP_JULIA_KERNEL");
+    }
+    if (!inst->handle) {
+        return false;
+    }
+
+    inst->gain = 3.0f;
+    inst->in.resize(n);
+    inst->out.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        inst->in[i] = 0.5f * sinf(2.0f * (float)M_PI * 440.0f * (float)i / (float)STRESS_RATE);
+    }
+    inst->desc->connect_port(inst->handle, 0, &inst->gain);
+    inst->desc->connect_port(inst->handle, 1, inst->in.data());
+    inst->desc->connect_port(inst->handle, 2, inst->out.data());
+    if (mode == MODE_CV) {
+        inst->cv.resize(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            inst->cv[i] = 6.0f * (float)i / (float)n;  // A sawtooth, one period per block
+        }
+        inst->desc->connect_port(inst->handle, 4, inst->cv.data());
+    }
+    inst->desc->activate(inst->handle);
+    return true;
+}
+
+static void
+instance_close(Instance* inst)
+{
+    if (inst->handle) {
+        inst->desc->deactivate(inst->handle);
+        inst->desc->cleanup(inst->handle);
+    }
+}
+
+/** Stressors run at normal priority, not the measuring thread's. */
+static void
+demote_thread(std::thread& thread)
+{
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(thread.native_handle(), SCHED_OTHER, &param);
+}
+
+static void
+pin_thread(std::thread& thread, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+static void
+burn_cpu(Stress* stress)
+{
+    volatile uint64_t x = 0;
+    while (!stress->stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 100000; ++i) {
+            x = x + 1;
+        }
+    }
+}
+
+static void
+hog_memory(Stress* stress)
+{
+    const size_t bytes = 64u << 20;  // Well past any last-level cache
+    char*        src   = (char*)malloc(bytes);
+    char*        dst   = (char*)malloc(bytes);
+    memset(src, 1, bytes);
+    memset(dst, 2, bytes);
+    while (!stress->stop.load(std::memory_order_relaxed)) {
+        memcpy(dst, src, bytes);
+        std::swap(src, dst);
+    }
+    free(src);
+    free(dst);
+}
+
+static void
+make_garbage(Stress* stress, const PluginLibrary* lib)
+{
+    while (!stress->stop.load(std::memory_order_relaxed)) {
+        // About 8 MB of short-lived arrays, enough for a collection every few calls
+        lib->worker_eval("let v = [zeros(Float64, 1024) for _ in 1:1000]; sum(length, v) end");
+        lib->worker_cpu();  // Wait for it, so the queue does not grow without bound
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static void
+churn_page_cache(Stress* stress)
+{
+    const char* dir = getenv("TMPDIR");
+    char        path[1024];
+    snprintf(path, sizeof(path), "%s/julia-amp-bench-XXXXXX", dir ? dir : "/var/tmp");
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "bench: cannot create %s, no page cache stress\n", path);
+        return;
+    }
+    unlink(path);
+
+    const size_t chunk = 1u << 20;
+    char*        buf   = (char*)malloc(chunk);
+    memset(buf, 3, chunk);
+    uint32_t seed = 1;
+    for (size_t offset = 0; !stress->stop.load(std::memory_order_relaxed);) {
+        if (pwrite(fd, buf, chunk, offset) < 0) {
+            break;
+        }
+        offset = (offset + chunk) % STRESS_CACHE_BYTES;
+        if (offset % (64u << 20) == 0) {
+            // Force writeback, drop the clean pages, and read some back cold
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            for (int i = 0; i < 16; ++i) {
+                seed = seed * 1103515245u + 12345u;
+                if (pread(fd, buf, chunk, (seed >> 8) % (STRESS_CACHE_BYTES / chunk) * chunk) < 0) {
+                    break;
+                }
+            }
+        }
+    }
+    free(buf);
+    close(fd);
+}
+
+static void
+stress_start(Stress* stress, Stressor stressor, const PluginLibrary* lib)
+{
+    stress->stop = false;
+    switch (stressor) {
+    case STRESS_NONE:
+        break;
+    case STRESS_CPU: {
+        const int cpu = lib->worker_cpu();
+        for (int i = 0; i < 2; ++i) {
+            stress->threads.emplace_back(burn_cpu, stress);
+            pin_thread(stress->threads.back(), cpu);
+        }
+        break;
+    }
+    case STRESS_MEM: {
+        const unsigned n = std::max(1u, std::thread::hardware_concurrency() / 2);
+        for (unsigned i = 0; i < n; ++i) {
+            stress->threads.emplace_back(hog_memory, stress);
+        }
+        break;
+    }
+    case STRESS_GC:
+        stress->threads.emplace_back(make_garbage, stress, lib);
+        break;
+    case STRESS_CACHE:
+        stress->threads.emplace_back(churn_page_cache, stress);
+        break;
+    case N_STRESSORS:
+        break;
+    }
+    for (std::thread& thread : stress->threads) {
+        demote_thread(thread);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));  // Let it ramp up
+}
+
+static void
+stress_stop(Stress* stress)
+{
+    stress->stop = true;
+    for (std::thread& thread : stress->threads) {
+        thread.join();
+    }
+    stress->threads.clear();
+}
+
+/** Runs `blocks` blocks at real-time pace, returning each run() time in µs. */
+static std::vector<double>
+time_blocks(Instance* inst, uint32_t n, uint32_t blocks)
+{
+    typedef std::chrono::steady_clock clock;
+
+    const clock::duration period = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(n / STRESS_RATE));
+
+    std::vector<double> times(blocks);
+    clock::time_point   deadline = clock::now();
+    for (uint32_t b = 0; b < blocks; ++b) {
+        const clock::time_point start = clock::now();
+        inst->desc->run(inst->handle, n);
+        times[b] = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+
+        deadline += period;
+        std::this_thread::sleep_until(deadline);
+    }
+    return times;
+}
+
+/** Upper bound of the histogram bucket that holds quantile `q`, in µs. */
+static double
+hist_quantile(const JuliaAmpTaskMetrics* m, double q)
+{
+    const uint64_t rank = (uint64_t)(q * m->count);
+    uint64_t       seen = 0;
+    for (uint32_t i = 0; i < JULIA_AMP_TASK_BUCKETS; ++i) {
+        seen += m->exec_hist[i];
+        if (seen > rank) {
+            return (double)(1ull << i);
+        }
+    }
+    return INFINITY;
+}
+
+static void
+print_worker_metrics(FILE* report, const PluginLibrary* lib)
+{
+    fprintf(report, "\n%-8s %8s  %10s %10s  %10s %10s %10s\n",
+            "task", "count", "wait us", "max wait", "exec us", "p99 <= us", "max exec");
+    for (uint32_t kind = 0; lib->task_kind_name(kind); ++kind) {
+        JuliaAmpTaskMetrics m;
+        if (lib->worker_metrics(kind, &m) || !m.count) {
+            continue;
+        }
+        fprintf(report, "%-8s %8llu  %10.1f %10.1f  %10.1f %10.0f %10.1f\n",
+                lib->task_kind_name(kind), (unsigned long long)m.count,
+                m.wait_ns / 1e3 / m.count, m.wait_max_ns / 1e3,
+                m.exec_ns / 1e3 / m.count, hist_quantile(&m, 0.99), m.exec_max_ns / 1e3);
+    }
+}
+
+static int
+bench_stress(int argc, char** argv)
+{
+    const char* bundle  = ".";
+    uint32_t    n       = 256;
+    uint32_t    blocks  = 2000;
+    bool        enabled[N_STRESSORS];
+
+    int c;
+    optind = 2;  // After "stress"
+    while ((c = getopt(argc, argv, "B:b:n:")) != -1) {
+        switch (c) {
+        case 'B': bundle = optarg; break;
+        case 'b': n = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'n': blocks = (uint32_t)strtoul(optarg, NULL, 10); break;
+        default: return 1;
+        }
+    }
+    for (int s = 0; s < N_STRESSORS; ++s) {
+        enabled[s] = optind == argc;
+    }
+    for (int i = optind; i < argc; ++i) {
+        int s = 0;
+        while (s < N_STRESSORS && strcmp(argv[i], stressor_names[s])) {
+            ++s;
+        }
+        if (s == N_STRESSORS) {
+            fprintf(stderr, "bench: unknown stressor '%s'\n", argv[i]);
+            return 1;
+        }
+        enabled[s] = true;
+    }
+    if (!n || !blocks) {
+        return 1;
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/julia-amp.so", bundle);
+    PluginLibrary lib;
+    lib.lib = dlopen(path, RTLD_NOW);
+    if (!lib.lib) {
+        fprintf(stderr, "bench: %s\n", dlerror());
+        return 1;
+    }
+    lib.worker_eval    = (decltype(lib.worker_eval))dlsym(lib.lib, "julia_amp_worker_eval");
+    lib.worker_cpu     = (decltype(lib.worker_cpu))dlsym(lib.lib, "julia_amp_worker_cpu");
+    lib.worker_metrics = (decltype(lib.worker_metrics))dlsym(lib.lib, "julia_amp_worker_metrics");
+    lib.task_kind_name = (decltype(lib.task_kind_name))dlsym(lib.lib, "julia_amp_task_kind_name");
+    if (!lib.worker_eval || !lib.worker_cpu || !lib.worker_metrics || !lib.task_kind_name) {
+        fprintf(stderr, "bench: %s does not export the worker hooks\n", path);
+        return 1;
+    }
+
+    // The plugin logs to stdout, keep that out of the report
+    fflush(stdout);
+    FILE*     report = fdopen(dup(STDOUT_FILENO), "w");
+    const int null   = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    Instance instances[N_MODES];
+    for (int m = 0; m < N_MODES; ++m) {
+        if (!instance_open(&instances[m], &lib, bundle, (Mode)m, n)) {
+            fprintf(stderr, "bench: failed to instantiate %s\n", path);
+            return 1;
+        }
+        time_blocks(&instances[m], n, 64);  // Warm up, compiles Julia kernels
+    }
+
+    // Measure from a real-time thread, like an audio callback would run.
+    // This comes after the Julia worker is started so it does not inherit it.
+    struct sched_param param;
+    param.sched_priority = 80;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+        fprintf(report, "note: SCHED_FIFO unavailable, timing at normal priority\n");
+    }
+
+    fprintf(report, "%-6s %-7s %6s  %8s %8s %8s %9s  %s\n",
+            "stress", "mode", "block", "p50 us", "p99 us", "p99.9 us", "max us", "overruns");
+    const double budget = n / STRESS_RATE * 1e6;
+    Stress       stress;
+    for (int s = 0; s < N_STRESSORS; ++s) {
+        if (!enabled[s]) {
+            continue;
+        }
+        stress_start(&stress, (Stressor)s, &lib);
+        for (int m = 0; m < N_MODES; ++m) {
+            std::vector<double> times = time_blocks(&instances[m], n, blocks);
+            std::sort(times.begin(), times.end());
+            const size_t overruns =
+                times.end() - std::upper_bound(times.begin(), times.end(), budget);
+            fprintf(report, "%-6s %-7s %6u  %8.1f %8.1f %8.1f %9.1f  %zu/%u\n",
+                    stressor_names[s], mode_names[m], n,
+                    times[blocks / 2], times[(size_t)(blocks * 0.99)],
+                    times[(size_t)(blocks * 0.999)], times[blocks - 1], overruns, blocks);
+            fflush(report);
+        }
+        stress_stop(&stress);
+    }
+
+    print_worker_metrics(report, &lib);
+
+    for (Instance& inst : instances) {
+        instance_close(&inst);
+    }
+    fclose(report);
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "stress")) {
+        return bench_stress(argc, argv);
+    } else if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            bench_gain((uint32_t)strtoul(argv[i], NULL, 10));
+            bench_limiter((uint32_t)strtoul(argv[i], NULL, 10));
+            bench_compressor((uint32_t)strtoul(argv[i], NULL, 10));
+        }
+    } else {
+        for (uint32_t n : default_lengths) {
+            bench_gain(n);
+        }
+        bench_limiter(256);
+        bench_compressor(256);
+    }
+    return 0;
+}
@@ -0,0 +1,482 @@
+/**
+   Shared Julia engine, see amp-engine.hpp.
+
+   Started by the first instance that runs with JULIA_AMP_ENGINE=1, from the
+   bundle directory, and detached from it.  Runs one Julia runtime with
+   amp.jl loaded for every instance of every process that connects, and
+   serves their calls one at a time from a single thread, the one that
+   initialized Julia.
+
+   Setting up a client may compile a kernel, which takes far longer than a
+   block.  That runs as a Julia task on another thread (Julia is started
+   with two unless JULIA_NUM_THREADS says otherwise), so the calls of the
+   clients already connected are served meanwhile.  The client gets its
+   welcome once the task is done.
+
+   Usage: julia-amp-engine BUNDLE SOCKET
+
+   Each connect and disconnect is logged to stderr with the number of
+   clients and the resident size of the engine, which is what a process
+   embedding Julia itself would have added to its own.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <vector>
+
+#include <julia.h>
+
+#include "amp-engine.hpp"
+#include "amp-kernels.hpp"
+
+/** Mirrors `julia_amp.Block`, like JuliaBlock in julia-amp.cpp. */
+typedef struct {
+    float*       out;
+    const float* in;
+    uint32_t     n;
+    float        gain;
+} Block;
+
+/**
+   A connection goes through three states: waiting for its hello (no
+   channel yet), setting up (a welcome is pending while its kernel
+   compiles, and the socket is out of the epoll set), and served.
+*/
+typedef struct {
+    int            sock;
+    EngineChannel* channel;
+    jl_value_t*    kernel;   // process! specialization, rooted by julia_amp.VARIANTS
+    EngineWelcome* pending;  // Filled by the setup task, sent when it is done
+    uint32_t       id;       // Key of the setup task
+} Client;
+
+typedef struct {
+    jl_function_t* db_to_coef;
+    jl_function_t* coefs;
+    jl_function_t* setup;   // JuliaAmpEngine.setup!
+    jl_function_t* ready;   // JuliaAmpEngine.ready
+    jl_function_t* collect; // JuliaAmpEngine.collect!
+    uint64_t       hash;    // hash_file() of amp.jl as included
+    char           stage[16];  // Set if loading amp.jl failed
+    char           what[128];
+} Script;
+
+/** Reports a pending Julia exception or a non-Float32 result into `stage` and `what`. */
+static bool
+julia_failed(char* stage, char* what, const char* where, jl_value_t* ret = NULL, bool check_ret = false)
+{
+    jl_value_t* exc = jl_exception_occurred();
+    if (!exc && !(check_ret && !(ret && jl_typeis(ret, jl_float32_type)))) {
+        return false;
+    }
+    snprintf(stage, 16, "%s", where);
+    snprintf(what, 128, "%s", exc ? jl_typeof_str(exc) : "result is not a Float32");
+    if (exc) {
+        jl_exception_clear();
+    }
+    return true;
+}
+
+static void
+log_clients(const char* event, size_t n_clients)
+{
+    long  pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    fprintf(stderr, "julia-amp-engine: %s, %zu clients, RSS %.1f MiB\n", event, n_clients,
+            pages * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0));
+}
+
+/**
+   Compiles a client's kernel, and its vectorization report, in a task.
+   Without threads the task runs to completion right away.
+*/
+static const char* const engine_jl =
+    "module JuliaAmpEngine\n"
+    "const SETUP = Dict{UInt32,Task}()\n"
+    "const COMPILING = ReentrantLock()\n"  // julia_amp.VARIANTS is a plain Dict
+    "function compile(block, flags, report)\n"
+    "    kernel = lock(() -> Main.julia_amp.variant(1, block, flags), COMPILING)\n"
+    "    if isdefined(Main.julia_amp, :report!)\n"
+    "        try\n"
+    "            Main.julia_amp.report!(report, kernel)\n"  // Optional, left zero on failure
+    "        catch\n"
+    "        end\n"
+    "    end\n"
+    "    return kernel\n"
+    "end\n"
+    "function setup!(id, block, flags, report)\n"
+    "    if Threads.nthreads() > 1\n"
+    "        SETUP[id] = Threads.@spawn compile(block, flags, report)\n"
+    "    else\n"
+    "        SETUP[id] = schedule(Task(() -> compile(block, flags, report)))\n"
+    "        yield()\n"
+    "    end\n"
+    "    return nothing\n"
+    "end\n"
+    "ready(id) = istaskdone(SETUP[id])\n"
+    "function collect!(id)\n"
+    "    task = pop!(SETUP, id)\n"
+    "    istaskfailed(task) && throw(task.exception)\n"
+    "    return fetch(task)\n"
+    "end\n"
+    "end\n"
+    "JuliaAmpEngine";
+
+static bool
+load_script(Script* script, const char* bundle_path)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/amp.jl", bundle_path);
+    hash_file(path, &script->hash);
+
+    char include[1100];
+    snprintf(include, sizeof(include), "include(raw\"%s\")", path);
+    jl_module_t* julia_amp = (jl_module_t*)jl_eval_string(include);
+    if (julia_failed(script->stage, script->what, "include")) {
+        return false;
+    }
+    script->db_to_coef = jl_get_function(julia_amp, "db_to_coef");
+    script->coefs      = jl_get_function(julia_amp, "coefs!");
+    if (julia_failed(script->stage, script->what, "lookup")) {
+        return false;
+    }
+
+    jl_module_t* engine = (jl_module_t*)jl_eval_string(engine_jl);
+    if (julia_failed(script->stage, script->what, "engine")) {
+        return false;
+    }
+    script->setup   = jl_get_function(engine, "setup!");
+    script->ready   = jl_get_function(engine, "ready");
+    script->collect = jl_get_function(engine, "collect!");
+    return !julia_failed(script->stage, script->what, "engine");
+}
+
+/**
+   Reads a client's hello and checks it.  A client that wants a kernel gets
+   its setup task started and its welcome later, from `finish()`; any other
+   is welcomed right away.  Returns false to drop the connection.
+*/
+static bool
+hello(Client* client, const Script* script)
+{
+    EngineHello hello;
+    const int   fd = engine_recv_fd(client->sock, &hello, sizeof(hello));
+    if (fd < 0) {
+        return false;
+    }
+    void* map = mmap(NULL, sizeof(EngineChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    client->channel = (EngineChannel*)map;
+
+    EngineWelcome* w = (EngineWelcome*)calloc(1, sizeof(EngineWelcome));
+    if (!w) {
+        return false;
+    }
+    if (hello.magic != ENGINE_MAGIC || hello.version != ENGINE_VERSION) {
+        w->failed = 1;
+        snprintf(w->stage, sizeof(w->stage), "engine");
+        snprintf(w->what, sizeof(w->what), "protocol mismatch");
+    } else if (hello.script_hash != script->hash) {
+        // Another version of amp.jl, which the instance hashed for its tables
+        w->failed = 1;
+        snprintf(w->stage, sizeof(w->stage), "engine");
+        snprintf(w->what, sizeof(w->what), "amp.jl changed");
+    } else if (script->stage[0]) {
+        w->failed = 1;
+        memcpy(w->stage, script->stage, sizeof(w->stage));
+        memcpy(w->what, script->what, sizeof(w->what));
+    } else {
+        jl_value_t* ret = jl_call1(script->db_to_coef, jl_box_float32(-3.0f));
+        if (julia_failed(w->stage, w->what, "activate", ret, true)) {
+            w->failed = 1;
+        } else {
+            w->coef = jl_unbox_float32(ret);
+        }
+    }
+
+    if (!w->failed && (hello.flags & ENGINE_JULIA_KERNEL)) {
+        jl_value_t** args;
+        JL_GC_PUSHARGS(args, 4);
+        args[0] = jl_box_uint32(client->id);
+        args[1] = jl_box_uint32(hello.block_length);
+        args[2] = jl_box_uint32((hello.flags & ENGINE_SANITIZE) ? 1u : 0u);
+        args[3] = jl_box_voidpointer(&w->report);
+        jl_call(script->setup, args, 4);
+        JL_GC_POP();
+        if (julia_failed(w->stage, w->what, "variant")) {
+            w->failed = 1;
+        } else {
+            client->pending = w;  // The task writes the report, keep it in place
+            return true;
+        }
+    }
+
+    const bool sent = engine_send_all(client->sock, w, sizeof(*w));
+    free(w);
+    return sent;
+}
+
+/**
+   Sends the welcome of a client whose setup task is done, with the
+   kernel's failure if it did not compile.  Returns false to drop it.
+*/
+static bool
+finish(Client* client, const Script* script)
+{
+    EngineWelcome* w      = client->pending;
+    jl_value_t*    kernel = jl_call1(script->collect, jl_box_uint32(client->id));
+    if (julia_failed(w->stage, w->what, "variant")) {
+        w->failed = 1;
+    } else {
+        client->kernel = kernel;
+    }
+    client->pending = NULL;
+    const bool sent = engine_send_all(client->sock, w, sizeof(*w));
+    free(w);
+    return sent;
+}
+
+/** Runs the request in a client's channel. */
+static void
+serve(Client* client, const Script* script)
+{
+    EngineChannel* ch = client->channel;
+    const uint32_t n  = ch->n < ENGINE_MAX_BLOCK ? ch->n : ENGINE_MAX_BLOCK;
+    Block          block;
+    jl_value_t*    ret    = NULL;
+    const char*    where  = "run";
+    ch->failed            = 0;
+
+    switch (ch->op) {
+    case ENGINE_OP_COEF:
+        ret = jl_call1(script->db_to_coef, jl_box_float32(ch->gain));
+        break;
+    case ENGINE_OP_COEFS:
+        block = {ch->out, ch->in, n, ch->gain};
+        ret   = jl_call1(script->coefs, jl_box_voidpointer(&block));
+        where = "control";
+        break;
+    case ENGINE_OP_PROCESS:
+        if (client->kernel) {
+            block = {ch->out, ch->in, n, ch->gain};
+            ret   = jl_call1(client->kernel, jl_box_voidpointer(&block));
+        }
+        where = "process!";
+        break;
+    }
+
+    if (julia_failed(ch->stage, ch->what, where, ret, true)) {
+        ch->failed = 1;
+    } else {
+        ch->result = jl_unbox_float32(ret);
+    }
+}
+
+static void
+drop(std::vector<Client>& clients, size_t i)
+{
+    if (clients[i].channel) {
+        munmap(clients[i].channel, sizeof(EngineChannel));
+    }
+    close(clients[i].sock);
+    clients.erase(clients.begin() + i);
+}
+
+/** Waits for events with the serving thread marked safe for other threads' GC. */
+static int
+wait_events(int epoll, struct epoll_event* events, int max_events, int timeout_ms)
+{
+    jl_ptls_t    ptls  = jl_current_task->ptls;
+    const int8_t state = jl_gc_safe_enter(ptls);
+    const int    n     = epoll_wait(epoll, events, max_events, timeout_ms);
+    jl_gc_safe_leave(ptls, state);
+    return n;
+}
+
+int
+main(int argc, char** argv)
+{
+    typedef std::chrono::steady_clock clock;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s BUNDLE SOCKET\n", argv[0]);
+        return 1;
+    }
+    const char* bundle_path = argv[1];
+    const char* path        = argv[2];
+    const char* idle_env    = getenv("JULIA_AMP_ENGINE_IDLE");
+    const int   idle_s      = idle_env ? atoi(idle_env) : 60;
+
+    // Outlive the process that started us, and keep none of its files open
+    setsid();
+    for (int fd = STDERR_FILENO + 1; fd < 1024; ++fd) {
+        close(fd);
+    }
+    const int null = open("/dev/null", O_RDONLY);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        close(null);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Only one engine per socket: the loser of a start race leaves quietly
+    char lock_path[1100];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    const int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB)) {
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    if (!engine_socket_addr(path, &addr)) {
+        fprintf(stderr, "julia-amp-engine: socket path %s is too long\n", path);
+        return 1;
+    }
+    unlink(path);  // Left over by an engine that crashed, we hold the lock
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) ||
+        listen(listener, 64)) {
+        fprintf(stderr, "julia-amp-engine: cannot listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // Clients can connect already, they wait for their welcome
+    const clock::time_point start = clock::now();
+    setenv("JULIA_NUM_THREADS", "2", 0);
+    jl_init();
+    Script script;
+    memset(&script, 0, sizeof(script));
+    if (!load_script(&script, bundle_path)) {
+        fprintf(stderr, "julia-amp-engine: Julia error in %s: %s\n", script.stage, script.what);
+    }
+    fprintf(stderr, "julia-amp-engine: Julia ready in %.0f ms\n",
+            std::chrono::duration<double, std::milli>(clock::now() - start).count());
+    log_clients("started", 0);
+
+    ScopedDenormals denormals;
+
+    const int          epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.fd  = listener;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &ev);
+
+    std::vector<Client> clients;
+    uint32_t            next_id    = 0;
+    size_t              n_pending  = 0;
+    clock::time_point   idle_since = clock::now();
+    for (;;) {
+        // Poll often while kernels compile, to welcome their clients soon after
+        struct epoll_event events[64];
+        const int          n_events = wait_events(epoll, events, 64, n_pending ? 5 : 1000);
+        if (n_events < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (int e = 0; e < n_events; ++e) {
+            const int fd = events[e].data.fd;
+            if (fd == listener) {
+                Client client = {accept4(listener, NULL, NULL, SOCK_CLOEXEC), NULL, NULL, NULL, next_id++};
+                if (client.sock < 0) {
+                    continue;
+                } else if (!engine_peer_trusted(client.sock)) {
+                    close(client.sock);  // Only serve our own user
+                    continue;
+                }
+                ev.events  = EPOLLIN;
+                ev.data.fd = client.sock;
+                epoll_ctl(epoll, EPOLL_CTL_ADD, client.sock, &ev);
+                clients.push_back(client);
+                continue;
+            }
+
+            for (size_t i = 0; i < clients.size(); ++i) {
+                if (clients[i].sock != fd) {
+                    continue;
+                }
+                char doorbell;
+                if (!clients[i].channel) {
+                    // A client sends its hello right after connecting
+                    if (!hello(&clients[i], &script)) {
+                        drop(clients, i);
+                    } else if (clients[i].pending) {
+                        epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+                        ++n_pending;
+                    } else {
+                        log_clients("connected", clients.size());
+                    }
+                } else if (recv(fd, &doorbell, 1, 0) != 1) {
+                    drop(clients, i);  // Also removes it from the epoll set
+                    log_clients("disconnected", clients.size());
+                } else {
+                    serve(&clients[i], &script);
+                    engine_send_all(fd, &doorbell, 1);
+                }
+                break;
+            }
+        }
+
+        for (size_t i = 0; n_pending && i < clients.size(); ++i) {
+            if (!clients[i].pending) {
+                continue;
+            }
+            jl_value_t* ready = jl_call1(script.ready, jl_box_uint32(clients[i].id));
+            if (jl_exception_occurred()) {
+                jl_exception_clear();  // finish() reports what went wrong
+            } else if (!jl_unbox_bool(ready)) {
+                continue;
+            }
+            --n_pending;
+            if (!finish(&clients[i], &script)) {
+                drop(clients, i--);
+                continue;
+            }
+            ev.events  = EPOLLIN;
+            ev.data.fd = clients[i].sock;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, clients[i].sock, &ev);
+            log_clients("connected", clients.size());
+        }
+
+        if (!clients.empty()) {
+            idle_since = clock::now();  // Idle time counts from the last client
+        }
+        if (clients.empty() && clock::now() - idle_since > std::chrono::seconds(idle_s)) {
+            break;
+        }
+    }
+
+    // New clients start a new engine from here on.  The name goes first, so
+    // that a new engine never has its socket unlinked by this one; clients
+    // retry the start if the new engine found the lock still held.
+    unlink(path);
+    close(lock);
+    close(listener);
+    for (size_t i = clients.size(); i-- > 0;) {
+        drop(clients, i);
+    }
+    log_clients("idle, exiting", 0);
+    jl_atexit_hook(0);
+    return 0;
+}
@@ -23,73 +23,412 @@
    included, in this case `lv2.h`.
 */
 #include "lv2/core/lv2.h"
+#include "lv2/atom/atom.h"
+#include "lv2/buf-size/buf-size.h"
+#include "lv2/options/options.h"
+#include "lv2/urid/urid.h"
 
 /** Include standard C headers */
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <future>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
 #include <julia.h>
 
+#include "julia-amp.h"
+#include "amp-engine.hpp"
+#include "amp-compressor.hpp"
+#include "amp-kernels.hpp"
+#include "amp-limiter.hpp"
+#include "amp-scope.hpp"
+#include "amp-table.hpp"
+#include "amp-tune.hpp"
+#include "amp-watchdog.hpp"
 
+/**
+   libjulia, loaded on the first activation that needs it.
+
+   The plugin is not linked against libjulia, so a host that only scans or
+   instantiates it never maps the Julia runtime.  `libjulia_open()` dlopens
+   it from JULIA_AMP_LIBJULIA, or else from the path the plugin was built
+   against, and resolves everything the plugin calls into `libjulia`.  The
+   jl_* names below are macros that go through this table; julia.h is only
+   used for its types.  Inline helpers from julia.h that would reference
+   libjulia directly are replaced: `jl_get_function()` by its definition and
+   `jl_typeis()` by `jl_isa()`, which is the same test for a concrete type.
+*/
+#ifndef JULIA_AMP_LIBJULIA_PATH
+#define JULIA_AMP_LIBJULIA_PATH "libjulia.so"
+#endif
+
+#define LIBJULIA_FUNCTIONS(X) \
+	X(jl_atexit_hook)         \
+	X(jl_box_float32)         \
+	X(jl_box_voidpointer)     \
+	X(jl_call1)               \
+	X(jl_call2)               \
+	X(jl_eval_string)         \
+	X(jl_exception_clear)     \
+	X(jl_exception_occurred)  \
+	X(jl_get_global)          \
+	X(jl_isa)                 \
+	X(jl_symbol)              \
+	X(jl_typeof_str)          \
+	X(jl_unbox_float32)
+
+typedef struct {
+	void* handle;
+#define LIBJULIA_FIELD(name) decltype(&::name) name;
+	LIBJULIA_FUNCTIONS(LIBJULIA_FIELD)
+#undef LIBJULIA_FIELD
+	decltype(&::jl_init) init;
+	jl_datatype_t**      float32_type;
+} LibJulia;
+
+static LibJulia libjulia;
+
+/** Loads libjulia once per process, returns false if it is not available. */
+static bool
+libjulia_open()
+{
+	static const bool loaded = [] {
+		const char* path = getenv("JULIA_AMP_LIBJULIA");
+		path             = path && *path ? path : JULIA_AMP_LIBJULIA_PATH;
+
+		// Embedding needs the runtime's symbols to be global, see
+		// https://discourse.julialang.org/t/embedding-julia-without-rtld-global-in-dlopen/37655
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		void* handle = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+		if (!handle) {
+			fprintf(stderr, "julia-amp: cannot load libjulia: %s\n", dlerror());
+			return false;
+		}
+
+		bool resolved = true;
+#define LIBJULIA_RESOLVE(name)                                                   \
+		libjulia.name = (decltype(libjulia.name))dlsym(handle, #name);           \
+		if (!libjulia.name) {                                                    \
+			fprintf(stderr, "julia-amp: %s is missing from %s\n", #name, path); \
+			resolved = false;                                                    \
+		}
+		LIBJULIA_FUNCTIONS(LIBJULIA_RESOLVE)
+#undef LIBJULIA_RESOLVE
+
+		// jl_init was an alias of jl_init__threading in older releases
+		libjulia.init = (decltype(libjulia.init))dlsym(handle, "jl_init");
+		if (!libjulia.init) {
+			libjulia.init = (decltype(libjulia.init))dlsym(handle, "jl_init__threading");
+		}
+		libjulia.float32_type = (jl_datatype_t**)dlsym(handle, "jl_float32_type");
+		if (!resolved || !libjulia.init || !libjulia.float32_type) {
+			fprintf(stderr, "julia-amp: %s is not a usable libjulia\n", path);
+			return false;
+		}
+		libjulia.handle = handle;
+		printf("Loaded %s in %.1f ms\n", path,
+		       std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		return true;
+	}();
+	return loaded;
+}
+
+#undef jl_init
+#undef jl_get_function
+#undef jl_typeis
+#undef jl_float32_type
+#define jl_atexit_hook          libjulia.jl_atexit_hook
+#define jl_box_float32          libjulia.jl_box_float32
+#define jl_box_voidpointer      libjulia.jl_box_voidpointer
+#define jl_call1                libjulia.jl_call1
+#define jl_call2                libjulia.jl_call2
+#define jl_eval_string          libjulia.jl_eval_string
+#define jl_exception_clear      libjulia.jl_exception_clear
+#define jl_exception_occurred   libjulia.jl_exception_occurred
+#define jl_get_global           libjulia.jl_get_global
+#define jl_isa                  libjulia.jl_isa
+#define jl_symbol               libjulia.jl_symbol
+#define jl_typeof_str           libjulia.jl_typeof_str
+#define jl_unbox_float32        libjulia.jl_unbox_float32
+#define jl_init                 libjulia.init
+#define jl_float32_type         (*libjulia.float32_type)
+#define jl_get_function(m, name) ((jl_function_t*)jl_get_global((m), jl_symbol(name)))
+#define jl_typeis(v, t)          jl_isa((v), (jl_value_t*)(t))
+
+/**
+   Runs tasks on a single thread that owns the Julia runtime.
+
+   Hosts with parallel graphs call `run()` on several audio threads at once,
+   so every submitting thread gets its own single-producer single-consumer
+   ring, registered lazily on its first submission.  Producers only touch
+   their own ring, and the shared mutex is only taken to register a ring or
+   when a ring is full.  The worker drains all rings round-robin and sleeps
+   on a semaphore, which producers only post when it is actually asleep.
+
+   Every task is tagged with a `JuliaAmpTaskKind` and stamped when it is
+   submitted, and the worker accounts its queue wait and execution time to
+   that kind.  The counters are only written by the worker thread, so they
+   are plain relaxed atomics that any thread can read.
+*/
 class Worker {
-    bool running = true;
+    typedef std::chrono::steady_clock Clock;
+
+    struct Task {
+        std::function<void()> fn;
+        JuliaAmpTaskKind      kind;
+        Clock::time_point     submitted;
+    };
+
+    struct KindStats {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> wait_ns;
+        std::atomic<uint64_t> wait_max_ns;
+        std::atomic<uint64_t> exec_ns;
+        std::atomic<uint64_t> exec_max_ns;
+        std::atomic<uint64_t> exec_hist[JULIA_AMP_TASK_BUCKETS];
+    };
+
+    struct Ring {
+        static const uint32_t size = 64;  // Power of two
+
+        std::thread::id       owner;
+        std::atomic<uint32_t> head{0};  // Written by the producer
+        std::atomic<uint32_t> tail{0};  // Written by the worker
+        Task                  slots[size];
+
+        bool push(Task&& task) {
+            const uint32_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) == size) {
+                return false;
+            }
+            slots[h & (size - 1)] = std::move(task);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(Task& task) {
+            const uint32_t t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire)) {
+                return false;
+            }
+            task                     = std::move(slots[t & (size - 1)]);
+            slots[t & (size - 1)].fn = nullptr;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+    };
+
+    static const uint32_t max_rings = 64;
+
+    std::atomic<bool> running{true};
+    std::atomic<bool> sleeping{false};
+    sem_t wakeup;
     std::thread t;
+
+    std::atomic<Ring*>    rings[max_rings] = {};
+    std::atomic<uint32_t> n_rings{0};
+
+    // Registration, and overflow for full rings or too many threads
     std::mutex mtx;
-    std::condition_variable cond;
-    std::deque<std::function<void()>> tasks;
+    std::deque<Task> tasks;
+    std::atomic<bool> overflowed{false};
+
+    KindStats stats[JULIA_AMP_N_TASK_KINDS];
 
 public:
-    Worker() : t{&Worker::threadFunc, this} {}
-    ~Worker() {
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            running = false;
+    Worker() {
+        for (KindStats& k : stats) {
+            k.count = k.wait_ns = k.wait_max_ns = k.exec_ns = k.exec_max_ns = 0;
+            for (std::atomic<uint64_t>& bucket : k.exec_hist) {
+                bucket = 0;
+            }
         }
-        cond.notify_one();
+        sem_init(&wakeup, 0, 0);
+        t = std::thread{&Worker::threadFunc, this};
+    }
+    ~Worker() {
+        running = false;
+        sem_post(&wakeup);
         t.join();
+        for (uint32_t i = 0; i < n_rings; ++i) {
+            delete rings[i].load();
+        }
+        sem_destroy(&wakeup);
     }
 
-    template <typename F> auto spawn(const F& f) -> std::packaged_task<decltype(f())()> {
+    template <typename F>
+    auto spawn(JuliaAmpTaskKind kind, const F& f) -> std::future<decltype(f())> {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(f);
+        submit(kind, [task] { (*task)(); });
+        return task->get_future();
+    }
+
+    template <typename F> auto run(JuliaAmpTaskKind kind, const F& f) -> decltype(f()) {
         std::packaged_task<decltype(f())()> task(f);
-        {
+        auto result = task.get_future();
+        submit(kind, [&task] { task(); });
+        return result.get();
+    }
+
+    template <typename F> void post(JuliaAmpTaskKind kind, const F& f) { submit(kind, f); }
+
+    void metrics(JuliaAmpTaskKind kind, JuliaAmpTaskMetrics* out) const {
+        const KindStats& k = stats[kind];
+        out->count       = k.count.load(std::memory_order_relaxed);
+        out->wait_ns     = k.wait_ns.load(std::memory_order_relaxed);
+        out->wait_max_ns = k.wait_max_ns.load(std::memory_order_relaxed);
+        out->exec_ns     = k.exec_ns.load(std::memory_order_relaxed);
+        out->exec_max_ns = k.exec_max_ns.load(std::memory_order_relaxed);
+        for (uint32_t i = 0; i < JULIA_AMP_TASK_BUCKETS; ++i) {
+            out->exec_hist[i] = k.exec_hist[i].load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    Ring* threadRing() {
+        thread_local Worker* cached_worker = NULL;
+        thread_local Ring*   cached_ring   = NULL;
+        if (cached_worker == this) {
+            return cached_ring;
+        }
+
+        const std::thread::id self = std::this_thread::get_id();
+        Ring*                 ring = NULL;
+        for (uint32_t i = 0; i < n_rings.load(std::memory_order_acquire) && !ring; ++i) {
+            Ring* r = rings[i].load(std::memory_order_acquire);
+            if (r->owner == self) {
+                ring = r;  // Registered by a previous thread with this id
+            }
+        }
+        if (!ring) {
             std::unique_lock<std::mutex> lock(mtx);
-            tasks.push_back([&task] { task(); });
+            const uint32_t               n = n_rings.load(std::memory_order_relaxed);
+            if (n == max_rings) {
+                return NULL;
+            }
+            ring        = new Ring;
+            ring->owner = self;
+            rings[n].store(ring, std::memory_order_release);
+            n_rings.store(n + 1, std::memory_order_release);
         }
-        cond.notify_one();
-        return task;
+
+        cached_worker = this;
+        cached_ring   = ring;
+        return ring;
     }
 
-    template <typename F> auto run(const F& f) -> decltype(f()) { return spawn(f).get_future().get(); }
+    void submit(JuliaAmpTaskKind kind, std::function<void()>&& fn) {
+        Task  task{std::move(fn), kind, Clock::now()};
+        Ring* ring = threadRing();
+        if (!ring || !ring->push(std::move(task))) {
+            std::unique_lock<std::mutex> lock(mtx);
+            tasks.push_back(std::move(task));
+            overflowed = true;
+        }
+        // Pairs with the store to `sleeping` in threadFunc(): either the
+        // worker sees the task when it rechecks, or we see it asleep
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load()) {
+            sem_post(&wakeup);
+        }
+    }
 
-private:
-    void threadFunc() {
-        while (true) {
-            std::function<void()> task;
-            {
-                std::unique_lock<std::mutex> lock(mtx);
-                while (tasks.empty() && running) {
-                    cond.wait(lock);
-                }
-                if (!running) {
-                    break;
-                }
+    bool pop(Task& task, uint32_t& next) {
+        const uint32_t n = n_rings.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; ++i) {
+            Ring* ring = rings[(next + i) % n].load(std::memory_order_acquire);
+            if (ring->pop(task)) {
+                next = (next + i + 1) % n;
+                return true;
+            }
+        }
+        if (overflowed.load(std::memory_order_acquire)) {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (!tasks.empty()) {
                 task = std::move(tasks.front());
                 tasks.pop_front();
+                overflowed = !tasks.empty();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Only called on the worker thread, the single writer of `stats`
+    static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static void raise(std::atomic<uint64_t>& counter, uint64_t value) {
+        if (value > counter.load(std::memory_order_relaxed)) {
+            counter.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    void execute(Task& task) {
+        const Clock::time_point start = Clock::now();
+        task.fn();
+        const Clock::time_point end = Clock::now();
+
+        const uint64_t wait_ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(start - task.submitted).count();
+        const uint64_t exec_ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        const uint64_t exec_us = exec_ns / 1000;
+        const uint32_t bucket  = exec_us ? 64 - __builtin_clzll(exec_us) : 0;
+
+        KindStats& k = stats[task.kind];
+        add(k.count, 1);
+        add(k.wait_ns, wait_ns);
+        raise(k.wait_max_ns, wait_ns);
+        add(k.exec_ns, exec_ns);
+        raise(k.exec_max_ns, exec_ns);
+        add(k.exec_hist[std::min(bucket, (uint32_t)JULIA_AMP_TASK_BUCKETS - 1)], 1);
+        task.fn = nullptr;  // Release captures before sleeping
+    }
+
+    void threadFunc() {
+        uint32_t next = 0;
+        while (running) {
+            Task task;
+            if (pop(task, next)) {
+                execute(task);
+                continue;
+            }
+
+            sleeping = true;
+            // Pairs with the fence in submit(): the recheck must not be
+            // reordered before the store, or a wakeup could be lost
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (pop(task, next)) {
+                sleeping = false;
+                execute(task);
+                continue;
             }
-            task();
+            while (sem_wait(&wakeup) && errno == EINTR) {
+            }
+            sleeping = false;
         }
     }
 };
@@ -106,25 +445,322 @@ private:
     }
 
     Julia() {
-        worker.run([] {
+        if (!libjulia_open()) {
+            return;  // Callers check libjulia_open() before running Julia code
+        }
+        worker.run(JULIA_AMP_TASK_INIT, [] {
             jl_init();
             jl_eval_string("println(\"JULIA  START\")");
         });
     }
     ~Julia() {
-        worker.run([] {
+        if (!libjulia.handle) {
+            return;
+        }
+        worker.run(JULIA_AMP_TASK_INIT, [] {
             jl_eval_string("println(\"JULIA END\")");
             jl_atexit_hook(0);
         });
     }
 
 public:
-    template <typename F> static auto spawn(const F& f) -> std::packaged_task<decltype(f())()> {
-        return instance().worker.spawn(f);
+    template <typename F>
+    static auto spawn(JuliaAmpTaskKind kind, const F& f) -> std::future<decltype(f())> {
+        return instance().worker.spawn(kind, f);
+    }
+    template <typename F> static auto run(JuliaAmpTaskKind kind, const F& f) -> decltype(f()) {
+        return instance().worker.run(kind, f);
+    }
+    template <typename F> static void post(JuliaAmpTaskKind kind, const F& f) {
+        instance().worker.post(kind, f);
     }
-    template <typename F> static auto run(const F& f) -> decltype(f()) { return instance().worker.run(f); }
     static void run(const char* s) {
-        return instance().worker.run([&] { jl_eval_string(s); });
+        return instance().worker.run(JULIA_AMP_TASK_EVAL, [&] { jl_eval_string(s); });
+    }
+    static void metrics(JuliaAmpTaskKind kind, JuliaAmpTaskMetrics* out) {
+        instance().worker.metrics(kind, out);
+    }
+};
+
+/**
+   On-demand profiling of the Julia worker, for rigs that start stuttering
+   in the middle of a session.
+
+   With JULIA_AMP_PROFILE_DIR set, creating `profile.trigger` in that
+   directory, or sending the signal number in JULIA_AMP_PROFILE_SIGNAL if set,
+   starts a capture of JULIA_AMP_PROFILE_SECONDS (10 by default).  SIGUSR1 and
+   SIGUSR2 belong to Julia's own profiler on Linux, so a real-time signal such
+   as 40 is a good choice, and the handler is only installed if nobody else
+   handles that signal.  Allocations are sampled at
+   JULIA_AMP_PROFILE_ALLOC_RATE (0.01 by default).
+
+   A watcher thread polls for the trigger and queues
+   `julia_amp.Profiling.start!` and later `stop!` on the worker, so the audio
+   thread only pays for the sampling itself.  The results are written to
+   `julia-amp-<pid>-<time>.cpu.folded` and `.alloc.folded` in the directory.
+*/
+class Profiler {
+    std::string       dir;
+    double            seconds;
+    double            alloc_rate;
+    int               signum;
+    struct sigaction  old_action;
+    std::atomic<bool> running{true};
+    std::thread       t;
+
+    static std::atomic<bool>& signalled() {
+        static std::atomic<bool> flag{false};
+        return flag;
+    }
+
+    static void onSignal(int) { signalled().store(true); }
+
+    Profiler() : seconds(10.0), alloc_rate(0.01), signum(0) {
+        const char* profile_dir = getenv("JULIA_AMP_PROFILE_DIR");
+        if (!profile_dir || !*profile_dir) {
+            return;
+        }
+        dir = profile_dir;
+
+        const char* secs = getenv("JULIA_AMP_PROFILE_SECONDS");
+        const char* rate = getenv("JULIA_AMP_PROFILE_ALLOC_RATE");
+        const char* sig  = getenv("JULIA_AMP_PROFILE_SIGNAL");
+        if (secs && strtod(secs, NULL) > 0.0) {
+            seconds = strtod(secs, NULL);
+        }
+        if (rate) {
+            alloc_rate = std::min(1.0, std::max(0.0, strtod(rate, NULL)));
+        }
+        if (sig && atoi(sig) > 0 && !sigaction(atoi(sig), NULL, &old_action) &&
+            old_action.sa_handler == SIG_DFL && !(old_action.sa_flags & SA_SIGINFO)) {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = &Profiler::onSignal;
+            action.sa_flags   = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            if (!sigaction(atoi(sig), &action, NULL)) {
+                signum = atoi(sig);
+            }
+        } else if (sig) {
+            fprintf(stderr, "julia-amp: signal %s is taken, profile with %s/profile.trigger\n",
+                    sig, profile_dir);
+        }
+
+        t = std::thread{&Profiler::watch, this};
+    }
+
+    ~Profiler() {
+        running = false;
+        if (t.joinable()) {
+            t.join();
+        }
+        if (signum) {
+            sigaction(signum, &old_action, NULL);
+        }
+    }
+
+    static void start(double alloc_rate) {
+        Julia::post(JULIA_AMP_TASK_PROFILE, [alloc_rate] {
+            char start[64];
+            snprintf(start, sizeof(start), "julia_amp.Profiling.start!(%g)", alloc_rate);
+            jl_eval_string(start);
+            if (jl_exception_occurred()) {
+                fprintf(stderr, "julia-amp: profiling failed to start: %s\n",
+                        jl_typeof_str(jl_exception_occurred()));
+                jl_exception_clear();
+            }
+        });
+    }
+
+    static void stop(const std::string& prefix) {
+        Julia::post(JULIA_AMP_TASK_PROFILE, [prefix] {
+            char stop[1100];
+            snprintf(stop, sizeof(stop), "julia_amp.Profiling.stop!(raw\"%s\")", prefix.c_str());
+            jl_eval_string(stop);
+            if (jl_exception_occurred()) {
+                fprintf(stderr, "julia-amp: failed to save profile: %s\n",
+                        jl_typeof_str(jl_exception_occurred()));
+                jl_exception_clear();
+            } else {
+                fprintf(stderr, "julia-amp: profile written to %s.{cpu,alloc}.folded\n",
+                        prefix.c_str());
+            }
+        });
+    }
+
+    void watch() {
+        typedef std::chrono::steady_clock clock;
+
+        const std::string trigger   = dir + "/profile.trigger";
+        bool              capturing = false;
+        clock::time_point end;
+        char              prefix[1024];
+        while (running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+            const bool requested = signalled().exchange(false) || !access(trigger.c_str(), F_OK);
+            if (!capturing && requested) {
+                unlink(trigger.c_str());
+                snprintf(prefix, sizeof(prefix), "%s/julia-amp-%d-%ld",
+                         dir.c_str(), (int)getpid(), (long)time(NULL));
+                fprintf(stderr, "julia-amp: profiling the Julia worker for %g s\n", seconds);
+                start(alloc_rate);
+                capturing = true;
+                end       = clock::now() + std::chrono::duration_cast<clock::duration>(
+                                         std::chrono::duration<double>(seconds));
+            } else if (capturing && clock::now() >= end) {
+                unlink(trigger.c_str());  // Requests during a capture are dropped
+                stop(prefix);
+                capturing = false;
+            }
+        }
+        if (capturing) {
+            stop(prefix);  // Still runs, Julia shuts down after us
+        }
+    }
+
+public:
+    /**
+       Starts watching for triggers, once per process.  Must be called after
+       Julia is up, so the profiler is destroyed (and stops) before Julia.
+    */
+    static void watchOnce() {
+        static Profiler profiler;
+    }
+};
+
+/**
+   Log for the audio thread, which must not block on stderr.  `push()` copies
+   a format string literal and its arguments into a bounded lock-free queue;
+   a thread prints them every 50 ms.  The format takes the strings first,
+   then the numbers, up to two of each; each entry records how many strings
+   it has, and numbers it does not use are ignored.  The strings are copied,
+   truncated to `len` bytes, so they need not outlive the call.  Entries
+   that do not fit are counted and reported as dropped.
+*/
+class RtLog {
+    static const uint32_t size = 256;  // Power of two
+    static const uint32_t len  = 128;
+
+    struct Entry {
+        const char* fmt;
+        uint32_t    n_s;  // Strings before the numbers
+        char        s[2][len];
+        double      v[2];
+    };
+
+    struct Slot {
+        std::atomic<uint32_t> seq;
+        Entry                 entry;
+    };
+
+    Slot                  slots[size];
+    std::atomic<uint32_t> head{0};  // Claimed by producers
+    uint32_t              tail = 0;
+    std::atomic<uint32_t> dropped{0};
+    std::atomic<bool>     running{true};
+    std::thread           t;
+
+    static RtLog& instance() {
+        static RtLog log;
+        return log;
+    }
+
+    RtLog() {
+        for (uint32_t i = 0; i < size; ++i) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+        t = std::thread{&RtLog::drain, this};
+    }
+
+    ~RtLog() {
+        running = false;
+        t.join();
+    }
+
+    bool pop(Entry& entry) {
+        Slot& slot = slots[tail & (size - 1)];
+        if ((int32_t)(slot.seq.load(std::memory_order_acquire) - (tail + 1)) < 0) {
+            return false;
+        }
+        entry = slot.entry;
+        slot.seq.store(tail + size, std::memory_order_release);
+        ++tail;
+        return true;
+    }
+
+    static void copy(char* dst, const char* src) {
+        uint32_t i = 0;
+        for (; src && src[i] && i + 1 < len; ++i) {
+            dst[i] = src[i];
+        }
+        dst[i] = '\0';
+    }
+
+    void drain() {
+        Entry entry;
+        for (bool last = false; !last;) {
+            last = !running;
+            std::this_thread::sleep_for(std::chrono::milliseconds(last ? 0 : 50));
+            while (pop(entry)) {
+                switch (entry.n_s) {
+                case 0:
+                    fprintf(stderr, entry.fmt, entry.v[0], entry.v[1]);
+                    break;
+                case 1:
+                    fprintf(stderr, entry.fmt, entry.s[0], entry.v[0], entry.v[1]);
+                    break;
+                default:
+                    fprintf(stderr, entry.fmt, entry.s[0], entry.s[1], entry.v[0], entry.v[1]);
+                    break;
+                }
+            }
+            if (const uint32_t n = dropped.exchange(0)) {
+                fprintf(stderr, "julia-amp: %u log messages dropped\n", n);
+            }
+        }
+    }
+
+public:
+    /** Starts the printing thread, from a thread that may block. */
+    static void start() { instance(); }
+
+    /** Real-time safe, from any thread once `start()` returned. */
+    static void push(const char* fmt, double v0 = 0.0, double v1 = 0.0) {
+        write(fmt, 0, NULL, NULL, v0, v1);
+    }
+    static void push(const char* fmt, const char* s0, double v0 = 0.0, double v1 = 0.0) {
+        write(fmt, 1, s0, NULL, v0, v1);
+    }
+    static void push(const char* fmt, const char* s0, const char* s1, double v0 = 0.0,
+                     double v1 = 0.0) {
+        write(fmt, 2, s0, s1, v0, v1);
+    }
+
+private:
+    static void write(const char* fmt, uint32_t n_s, const char* s0, const char* s1, double v0,
+                      double v1) {
+        RtLog&   log = instance();
+        uint32_t pos = log.head.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot&         slot = log.slots[pos & (size - 1)];
+            const int32_t dif  = (int32_t)(slot.seq.load(std::memory_order_acquire) - pos);
+            if (dif == 0 && log.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.entry.fmt  = fmt;
+                slot.entry.n_s  = n_s;
+                slot.entry.v[0] = v0;
+                slot.entry.v[1] = v1;
+                copy(slot.entry.s[0], s0);
+                copy(slot.entry.s[1], s1);
+                slot.seq.store(pos + 1, std::memory_order_release);
+                return;
+            } else if (dif < 0) {
+                log.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else if (dif > 0) {
+                pos = log.head.load(std::memory_order_relaxed);
+            }
+        }
     }
 };
 
@@ -148,11 +784,137 @@ extern "C" {
    should be defined for readability.
 */
 typedef enum {
-	AMP_GAIN   = 0,
-	AMP_INPUT  = 1,
-	AMP_OUTPUT = 2
+	AMP_GAIN    = 0,
+	AMP_INPUT   = 1,
+	AMP_OUTPUT  = 2,
+	AMP_LEVEL   = 3,
+	AMP_GAIN_CV   = 4,
+	AMP_ENABLED   = 5,
+	AMP_LIMIT     = 6,
+	AMP_CEILING   = 7,
+	AMP_LOOKAHEAD = 8,
+	AMP_LATENCY   = 9,
+	AMP_COMPRESS  = 10,
+	AMP_THRESHOLD = 11,
+	AMP_RATIO     = 12,
+	AMP_KNEE      = 13,
+	AMP_ATTACK    = 14,
+	AMP_RELEASE   = 15,
+	AMP_NOTIFY    = 16
 } PortIndex;
 
+/**
+   Ports from `AMP_LEVEL` on are `lv2:connectionOptional`, and the host passes
+   NULL to `connect_port()` for the ones it leaves unconnected.  Anything that
+   only feeds an unconnected port is skipped in `run()`.
+*/
+#define AMP_CONNECTED(port) (1u << (port))
+
+/** Longest limiter lookahead, the maximum of the `lookahead` port. */
+#define AMP_MAX_LOOKAHEAD_MS 20.0
+
+/** Limiter release time constant. */
+#define AMP_LIMITER_RELEASE_MS 50.0
+
+/** Compressor settings while its ports are unconnected, the ports' defaults. */
+#define AMP_COMPRESSOR_THRESHOLD -18.0f
+#define AMP_COMPRESSOR_RATIO     4.0f
+#define AMP_COMPRESSOR_KNEE      6.0f
+#define AMP_COMPRESSOR_ATTACK    5.0f
+#define AMP_COMPRESSOR_RELEASE   100.0f
+
+/** Output samples per scope summary, unless JULIA_AMP_SCOPE_DECIMATION says. */
+#define AMP_SCOPE_DECIMATION 256
+
+/** Length of the crossfade when the `enabled` port changes, in samples. */
+#define AMP_BYPASS_FADE 128
+
+/**
+   Gain law table for JULIA_AMP_GAIN_TABLE=1: `db_to_coef` from -20 to 20 dB,
+   the range of gain plus CV, in 0.01 dB steps.
+*/
+#define AMP_GAIN_TABLE_LO    -20.0f
+#define AMP_GAIN_TABLE_STEP  0.01f
+#define AMP_GAIN_TABLE_COUNT 4001
+
+/** Blocks per timing window of the activation warm-up. */
+#define AMP_WARMUP_WINDOW 8
+
+/** Bytes of the notify buffer the warm-up writes scope events to. */
+#define AMP_WARMUP_NOTIFY 8192
+
+/**
+   What `run()` does while the instance is latched after a Julia failure:
+   hold the last good coefficient, or pass the input through unchanged.
+*/
+typedef enum {
+	AMP_FALLBACK_HOLD   = 0,
+	AMP_FALLBACK_BYPASS = 1
+} FallbackMode;
+
+/**
+   How `process()` gets the gain, from the most to the least expensive.  The
+   latency watchdog (JULIA_AMP_LATENCY_BUDGET) steps down this list when
+   blocks take too long, and back up to the configured mode when they are
+   fast again.
+*/
+typedef enum {
+	AMP_MODE_JULIA_KERNEL = 0,  // The Julia process! kernel (JULIA_AMP_JULIA_KERNEL=1)
+	AMP_MODE_NATIVE       = 1,  // Coefficients from Julia, native gain kernel
+	AMP_MODE_TABLE        = 2,  // Coefficients from the gain table, no Julia
+	AMP_MODE_HOLD         = 3,  // Last coefficient, ignores gain changes and the CV
+	AMP_N_MODES
+} AmpMode;
+
+static const char* const amp_mode_names[AMP_N_MODES] = {
+	"Julia kernel", "native kernel", "gain table", "hold"
+};
+
+/**
+   Per-instance Julia error state.  Only the thread that calls into Julia (the
+   worker, or the audio thread with the shared engine) writes `stage`, `what`
+   and `failures`; the audio thread only looks at the two flags, so a failing
+   script costs `run()` one atomic load per block instead of a round trip to
+   Julia.
+*/
+typedef struct {
+	std::atomic<bool> latched;  // Julia failed, run() must not call into it
+	std::atomic<bool> probing;  // A recovery probe is queued on the worker
+	uint32_t          failures;
+	char              stage[16];
+	char              what[128];
+} JuliaError;
+
+/**
+   Arguments of a Julia block kernel, read on the Julia side as
+   `julia_amp.Block` through a single pointer, so a call boxes one value.
+*/
+typedef struct {
+	float*       out;
+	const float* in;
+	uint32_t     n;
+	float        gain;
+} JuliaBlock;
+
+/**
+   Control-rate evaluation of a Julia function of a control signal.
+
+   Calling into Julia per sample is too slow, so the function is evaluated
+   every `k` samples (JULIA_AMP_CONTROL_RATE, 32 by default), all control
+   points of a block in one call.  The results are linearly interpolated back
+   to audio rate.  Each block ramps from the last point of the previous one,
+   so the output is continuous across blocks.
+*/
+typedef struct {
+	uint32_t    k;       // Samples per control point
+	uint32_t    len;     // Capacity of `audio` in samples
+	float*      audio;   // Interpolated, audio-rate values
+	float*      in;      // Decimated input, one per control point
+	float*      points;  // Julia results, one per control point
+	float       last;    // Value at the end of the previous block, or NAN
+	jl_value_t* fn;      // Julia control function, julia_amp.coefs!
+} ControlRate;
+
 /**
    Every plugin defines a private structure for the plugin instance.  All data
    associated with a plugin instance is stored here, and is available to
@@ -165,14 +927,310 @@ typedef struct {
 	const float* input;
 	float*       output;
   jl_function_t* db_to_coef;
+	float*       level;    // Optional, peak output level in dB
+	const float* gain_cv;  // Optional, gain offset in dB per sample
+	const float* enabled_port;  // Optional, lv2:enabled
+	const float* limit;         // Optional, limiter on/off
+	const float* ceiling;       // Optional, limiter ceiling in dB
+	const float* lookahead;     // Optional, limiter lookahead in ms
+	float*       latency;       // Optional, lv2:latency
+	const float* compress;      // Optional, compressor on/off
+	const float* threshold;     // Optional, compressor threshold in dB
+	const float* ratio;         // Optional, compressor ratio
+	const float* knee;          // Optional, compressor knee width in dB
+	const float* attack;        // Optional, compressor attack in ms
+	const float* release;       // Optional, compressor release in ms
+	LV2_Atom_Sequence* notify;  // Optional, scope summaries for UIs
+
+	// AMP_CONNECTED() bits of the ports with a buffer
+	uint32_t connected;
+
+	// Bypass state: the wet share of the output (0 bypassed, 1 enabled) moves
+	// towards `enabled` over `fade_remaining` samples
+	bool     enabled;
+	float    wet;
+	uint32_t fade_remaining;
+	float    dry[AMP_BYPASS_FADE];
+
+	// Output limiter, allocated for AMP_MAX_LOOKAHEAD_MS at instantiation
+	Limiter  limiter;
+	bool     limiting;
+	float    limiter_lookahead;
+
+	// Compressor before the limiter, with the port values its coefficients
+	// were computed from.  The static curve comes from `julia_amp.curve!` if
+	// JULIA_AMP_COMPRESSOR_CURVE=julia.
+	Compressor  compressor;
+	bool        compressing;
+	float       compressor_settings[5];
+	bool        use_julia_curve;
+	jl_value_t* curve_fn;
+	SharedTable curve_table;
+
+	// Scope feed for the notify port, disabled without urid:map
+	Scope scope;
+
+	// Last coefficient that came back finite from Julia
+	float coef;
+	// Replace NaN/Inf in the output with silence (JULIA_AMP_SANITIZE=0 disables)
+	bool  sanitize;
+
+	double       rate;
+	char*        bundle_path;
+	uint64_t     script_hash;  // hash_file() of amp.jl at activation, 0 if unreadable
+	FallbackMode fallback;
+	JuliaError   error;
+	uint32_t     samples_since_probe;
+
+	// Nominal (or maximum) block length from the host, or a guess
+	uint32_t              block_length;
+	uint32_t              max_block_length;  // 0 if the host did not say
+	const GainKernelInfo* kernel;
+
+	// Gain law applied to the gain CV.  Its buffers are allocated by
+	// `activate()` only if the CV port is connected at that point.
+	ControlRate control;
+
+	// Julia `process!` specialization for this configuration, if requested
+	// with JULIA_AMP_JULIA_KERNEL=1.  Rooted by `VARIANTS` in the script's
+	// module, which activate() includes once per version of amp.jl.
+	bool        use_julia_kernel;
+	jl_value_t* julia_kernel;
+	JuliaBlock  julia_block;
+
+	// What the Julia kernel (in-process or the engine's) compiled to.  With
+	// JULIA_AMP_KERNEL_STRICT=1, one whose loop did not vectorize is refused.
+	bool                 strict_kernel;
+	JuliaAmpKernelReport kernel_report;
+
+	// Gain law sampled from Julia, shared between processes, which replaces
+	// the per-block call into Julia if JULIA_AMP_GAIN_TABLE=1
+	bool        use_gain_table;
+	SharedTable gain_table;
+
+	// Connection to the shared Julia engine if JULIA_AMP_ENGINE=1, which then
+	// replaces the in-process runtime (see amp-engine.hpp)
+	bool         use_engine;
+	EngineClient engine;
+
+	// Current and configured processing mode, and the watchdog moving
+	// between them.  The watchdog needs the gain table, so it is opened
+	// whenever the watchdog is enabled.
+	AmpMode  mode;
+	AmpMode  top_mode;
+	Watchdog watchdog;
 } Amp;
 
+/**
+   Records a Julia failure.  The first one is recorded and latches the
+   instance; later ones only bump the counter, so an error storm does not turn
+   into a log storm.
+*/
+static void
+latch_error(Amp* self, const char* stage, const char* what)
+{
+	if (!self->error.latched.load(std::memory_order_relaxed)) {
+		snprintf(self->error.stage, sizeof(self->error.stage), "%s", stage);
+		snprintf(self->error.what, sizeof(self->error.what), "%s", what);
+		RtLog::push(self->fallback == AMP_FALLBACK_BYPASS
+		                ? "julia-amp: Julia error in %s: %s, falling back to bypass\n"
+		                : "julia-amp: Julia error in %s: %s, falling back to last coefficient\n",
+		            self->error.stage, self->error.what);
+		self->error.latched.store(true, std::memory_order_release);
+	}
+	++self->error.failures;
+}
+
+/** Checks for a pending Julia exception after a call made on the worker thread. */
+static bool
+julia_failed(Amp* self, const char* stage, jl_value_t* ret = NULL, bool check_ret = false)
+{
+	jl_value_t* exc = jl_exception_occurred();
+	if (!exc && !(check_ret && !(ret && jl_typeis(ret, jl_float32_type)))) {
+		return false;
+	}
+
+	latch_error(self, stage, exc ? jl_typeof_str(exc) : "result is not a Float32");
+	if (exc) {
+		jl_exception_clear();
+	}
+	return true;
+}
+
+/**
+   Runs one request on the shared engine, on the calling thread.  Returns the
+   result, or NAN after latching the instance if Julia failed in the engine or
+   the engine is gone.
+*/
+static float
+engine_run(Amp* self, EngineOp op, uint32_t n, float gain)
+{
+	EngineChannel* channel = self->engine.channel;
+	channel->op   = op;
+	channel->n    = n;
+	channel->gain = gain;
+	if (!engine_call(&self->engine)) {
+		latch_error(self, "engine", errno == EAGAIN ? "timed out" : "connection lost");
+		return NAN;
+	} else if (channel->failed) {
+		latch_error(self, channel->stage, channel->what);
+		return NAN;
+	}
+	return channel->result;
+}
+
+/** The engine's `process!` kernel over a block, in channel-sized chunks. */
+static float
+engine_process(Amp* self, float* out, const float* in, uint32_t n, float gain)
+{
+	EngineChannel* channel = self->engine.channel;
+	float          coef    = NAN;
+	for (uint32_t offset = 0; offset < n; offset += ENGINE_MAX_BLOCK) {
+		const uint32_t chunk = std::min(n - offset, (uint32_t)ENGINE_MAX_BLOCK);
+		memcpy(channel->in, in + offset, chunk * sizeof(float));
+		coef = engine_run(self, ENGINE_OP_PROCESS, chunk, gain);
+		if (!is_finite(coef)) {
+			return NAN;
+		}
+		memcpy(out + offset, channel->out, chunk * sizeof(float));
+	}
+	return coef;
+}
+
+/** Connects the instance to the shared engine, returns db_to_coef(-3) or NAN. */
+static float
+engine_open(Amp* self)
+{
+	typedef std::chrono::steady_clock clock;
+
+	const clock::time_point start = clock::now();
+	const EngineHello       hello = {
+	    ENGINE_MAGIC, ENGINE_VERSION,
+	    (self->use_julia_kernel ? (uint32_t)ENGINE_JULIA_KERNEL : 0u) |
+	        (self->sanitize ? (uint32_t)ENGINE_SANITIZE : 0u),
+	    self->block_length,
+	    self->script_hash};
+	EngineWelcome welcome;
+
+	engine_client_close(&self->engine);
+	if (!engine_client_open(&self->engine, self->bundle_path, &hello, &welcome)) {
+		latch_error(self, "engine", "cannot connect");
+		return NAN;
+	}
+	printf("Engine connected in %.1f ms\n",
+	       std::chrono::duration<double, std::milli>(clock::now() - start).count());
+	if (welcome.failed) {
+		latch_error(self, welcome.stage, welcome.what);
+		return NAN;
+	}
+	self->kernel_report = welcome.report;
+	return welcome.coef;
+}
+
+/**
+   Logs the vectorization report of the Julia kernel, and refuses the kernel
+   if its loop did not vectorize in strict mode.  A kernel without a report
+   is accepted.  Returns false if the kernel is refused.
+*/
+static bool
+accept_kernel(Amp* self)
+{
+	JuliaAmpKernelReport* report = &self->kernel_report;
+	if (!report->width) {
+		printf("Julia kernel: no vectorization report\n");
+		return true;
+	}
+	printf("Julia kernel: %d x float (%d-bit), %s loop, %d bounds checks\n", report->width,
+	       32 * report->width, report->vectorized ? "vectorized" : "scalar", report->boundschecks);
+	report->refused = self->strict_kernel && !report->vectorized;
+	if (report->refused) {
+		fprintf(stderr, "julia-amp: the Julia kernel did not vectorize, using the native kernel "
+		                "(JULIA_AMP_KERNEL_STRICT=1)\n");
+	}
+	return !report->refused;
+}
+
+static void
+control_rate_free(ControlRate* control)
+{
+	free(control->audio);
+	free(control->in);
+	free(control->points);
+	memset(control, 0, sizeof(ControlRate));
+}
+
+static bool
+control_rate_init(ControlRate* control, uint32_t len, uint32_t k)
+{
+	const uint32_t n_points = len / (k ? k : 1) + 1;
+
+	control->k      = k ? k : 1;
+	control->len    = len;
+	control->audio  = (float*)calloc(len, sizeof(float));
+	control->in     = (float*)calloc(n_points, sizeof(float));
+	control->points = (float*)calloc(n_points, sizeof(float));
+	control->last   = NAN;
+	if (!control->audio || !control->in || !control->points) {
+		control_rate_free(control);
+		return false;
+	}
+	return true;
+}
+
+/**
+   Evaluates the control function for `n` (at most `control.len`) samples of
+   `cv` into `control.audio`.  Returns the coefficient for `gain` alone, or
+   NAN if Julia failed.
+*/
+static float
+control_rate_run(Amp* self, const float* cv, uint32_t n, float gain)
+{
+	ControlRate*   control  = &self->control;
+	const uint32_t k        = control->k;
+	const uint32_t n_points = (n + k - 1) / k;
+
+	// Each point takes the input at the end of its segment
+	for (uint32_t j = 0; j < n_points; ++j) {
+		control->in[j] = cv[std::min((j + 1) * k, n) - 1];
+	}
+
+	float coef;
+	if (self->engine.channel) {
+		memcpy(self->engine.channel->in, control->in, n_points * sizeof(float));
+		coef = engine_run(self, ENGINE_OP_COEFS, n_points, gain);
+		memcpy(control->points, self->engine.channel->out, n_points * sizeof(float));
+	} else {
+		self->julia_block = {control->points, control->in, n_points, gain};
+		coef              = Julia::run(JULIA_AMP_TASK_BLOCK, [self] {
+			ScopedDenormals denormals;
+			jl_value_t* ret = jl_call1(self->control.fn, jl_box_voidpointer(&self->julia_block));
+			if (julia_failed(self, "control", ret, true)) {
+				return NAN;
+			}
+			return jl_unbox_float32(ret);
+		});
+	}
+	if (!is_finite(coef)) {
+		return NAN;
+	}
+
+	float from = is_finite(control->last) ? control->last : control->points[0];
+	for (uint32_t j = 0; j < n_points; ++j) {
+		const uint32_t start = j * k;
+		fill_ramp(control->audio + start, from, control->points[j], std::min(k, n - start));
+		from = control->points[j];
+	}
+	control->last = from;
+	return coef;
+}
+
 /**
    The `instantiate()` function is called by the host to create a new plugin
    instance.  The host passes the plugin descriptor, sample rate, and bundle
    path for plugins that need to load additional resources (e.g. waveforms).
    The features parameter contains host-provided features defined in LV2
-   extensions, but this simple plugin does not use any.
+   extensions.  If the host provides options with the block length, the gain
+   kernel is tuned for it (see amp-tune.hpp).
 
    This function is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -184,6 +1242,83 @@ instantiate(const LV2_Descriptor*     descriptor,
             const LV2_Feature* const* features)
 {
 	Amp* amp = (Amp*)calloc(1, sizeof(Amp));
+	if (!amp) {
+		return NULL;
+	}
+
+	const char* sanitize = getenv("JULIA_AMP_SANITIZE");
+	const char* fallback = getenv("JULIA_AMP_FALLBACK");
+	amp->coef        = 1.0f;
+	amp->enabled     = true;
+	amp->wet         = 1.0f;
+	amp->sanitize    = !sanitize || strcmp(sanitize, "0") != 0;
+	amp->rate        = rate;
+	amp->bundle_path = strdup(bundle_path);
+	amp->fallback    = (fallback && !strcmp(fallback, "bypass")) ? AMP_FALLBACK_BYPASS
+	                                                            : AMP_FALLBACK_HOLD;
+
+	const LV2_URID_Map*       map     = NULL;
+	const LV2_Options_Option* options = NULL;
+	for (int i = 0; features && features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_URID__map)) {
+			map = (const LV2_URID_Map*)features[i]->data;
+		} else if (!strcmp(features[i]->URI, LV2_OPTIONS__options)) {
+			options = (const LV2_Options_Option*)features[i]->data;
+		}
+	}
+
+	amp->block_length = 256;
+	if (map && options) {
+		const LV2_URID atom_Int = map->map(map->handle, LV2_ATOM__Int);
+		const LV2_URID nominal  = map->map(map->handle, LV2_BUF_SIZE__nominalBlockLength);
+		const LV2_URID maximum  = map->map(map->handle, LV2_BUF_SIZE__maxBlockLength);
+		bool           have_nominal = false;
+		for (const LV2_Options_Option* o = options; o->key; ++o) {
+			if (o->type != atom_Int || !o->value || *(const int32_t*)o->value <= 0) {
+				continue;
+			}
+			if (o->key == nominal) {
+				amp->block_length = *(const int32_t*)o->value;
+				have_nominal      = true;
+			} else if (o->key == maximum) {
+				amp->max_block_length = *(const int32_t*)o->value;
+				if (!have_nominal) {
+					amp->block_length = amp->max_block_length;
+				}
+			}
+		}
+	}
+
+	if (!limiter_init(&amp->limiter, (uint32_t)(AMP_MAX_LOOKAHEAD_MS * 0.001 * rate) + 1)) {
+		free(amp->bundle_path);
+		free(amp);
+		return NULL;
+	}
+
+	const char* kernel    = getenv("JULIA_AMP_JULIA_KERNEL");
+	amp->use_julia_kernel = kernel && strcmp(kernel, "0") != 0;
+
+	const char* strict = getenv("JULIA_AMP_KERNEL_STRICT");
+	amp->strict_kernel = strict && strcmp(strict, "0") != 0;
+
+	const char* gain_table = getenv("JULIA_AMP_GAIN_TABLE");
+	amp->use_gain_table    = gain_table && strcmp(gain_table, "0") != 0;
+
+	const char* engine = getenv("JULIA_AMP_ENGINE");
+	amp->use_engine    = engine && strcmp(engine, "0") != 0;
+
+	const char* curve    = getenv("JULIA_AMP_COMPRESSOR_CURVE");
+	amp->use_julia_curve = curve && !strcmp(curve, "julia");
+
+	const char* budget = getenv("JULIA_AMP_LATENCY_BUDGET");
+	watchdog_reset(&amp->watchdog, budget ? std::max(0.0f, strtof(budget, NULL)) : 0.0f);
+	amp->kernel = select_gain_kernel(bundle_path, amp->block_length, amp->sanitize);
+
+	const char* decimation = getenv("JULIA_AMP_SCOPE_DECIMATION");
+	if (map && !scope_init(&amp->scope, decimation ? (uint32_t)atoi(decimation) : AMP_SCOPE_DECIMATION,
+	                       map, AMP_URI)) {
+		fprintf(stderr, "julia-amp: no memory for the scope feed, disabled\n");
+	}
 
 	return (LV2_Handle)amp;
 }
@@ -213,14 +1348,129 @@ connect_port(LV2_Handle instance,
 	case AMP_OUTPUT:
 		amp->output = (float*)data;
 		break;
+	case AMP_LEVEL:
+		amp->level = (float*)data;
+		break;
+	case AMP_GAIN_CV:
+		amp->gain_cv = (const float*)data;
+		break;
+	case AMP_ENABLED:
+		amp->enabled_port = (const float*)data;
+		break;
+	case AMP_LIMIT:
+		amp->limit = (const float*)data;
+		break;
+	case AMP_CEILING:
+		amp->ceiling = (const float*)data;
+		break;
+	case AMP_LOOKAHEAD:
+		amp->lookahead = (const float*)data;
+		break;
+	case AMP_LATENCY:
+		amp->latency = (float*)data;
+		break;
+	case AMP_COMPRESS:
+		amp->compress = (const float*)data;
+		break;
+	case AMP_THRESHOLD:
+		amp->threshold = (const float*)data;
+		break;
+	case AMP_RATIO:
+		amp->ratio = (const float*)data;
+		break;
+	case AMP_KNEE:
+		amp->knee = (const float*)data;
+		break;
+	case AMP_ATTACK:
+		amp->attack = (const float*)data;
+		break;
+	case AMP_RELEASE:
+		amp->release = (const float*)data;
+		break;
+	case AMP_NOTIFY:
+		amp->notify = (LV2_Atom_Sequence*)data;
+		break;
+	default:
+		return;
+	}
+
+	if (data) {
+		amp->connected |= AMP_CONNECTED(port);
+	} else {
+		amp->connected &= ~AMP_CONNECTED(port);
+	}
+}
+
+static void
+warm_up(Amp* self, uint32_t max_blocks);
+
+/**
+   Fills `values[i]` with a Julia block function of lo + i * step, called
+   like `coefs!` with a gain of 0, on the worker.
+*/
+static bool
+sample_julia(Amp* self, jl_value_t* fn, float* values, uint32_t count, float lo, float step)
+{
+	float* x = (float*)malloc(count * sizeof(float));
+	if (!x) {
+		return false;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		x[i] = lo + (float)i * step;
+	}
+
+	JuliaBlock block = {values, x, count, 0.0f};
+	const bool ok    = Julia::run(JULIA_AMP_TASK_TABLE, [self, fn, &block] {
+		jl_value_t* ret = jl_call1(fn, jl_box_voidpointer(&block));
+		return !julia_failed(self, "table", ret, true);
+	});
+	free(x);
+	return ok;
+}
+
+/** Samples the gain law with `coefs!`, for `shared_table_open()`. */
+static bool
+build_gain_table(float* values, uint32_t count, float lo, float step, void* data)
+{
+	Amp* self = (Amp*)data;
+	if (self->engine.channel) {
+		EngineChannel* channel = self->engine.channel;
+		for (uint32_t offset = 0; offset < count; offset += ENGINE_MAX_BLOCK) {
+			const uint32_t chunk = std::min(count - offset, (uint32_t)ENGINE_MAX_BLOCK);
+			for (uint32_t i = 0; i < chunk; ++i) {
+				channel->in[i] = lo + (float)(offset + i) * step;
+			}
+			if (!is_finite(engine_run(self, ENGINE_OP_COEFS, chunk, 0.0f))) {
+				return false;
+			}
+			memcpy(values + offset, channel->out, chunk * sizeof(float));
+		}
+		return true;
 	}
+
+	return sample_julia(self, self->control.fn, values, count, lo, step);
+}
+
+/** Samples the compressor curve with `curve!`, for `shared_table_open()`. */
+static bool
+build_curve_table(float* values, uint32_t count, float lo, float step, void* data)
+{
+	Amp* self = (Amp*)data;
+	return sample_julia(self, self->curve_fn, values, count, lo, step);
 }
 
 /**
    The `activate()` method is called by the host to initialise and prepare the
    plugin instance for running.  The plugin must reset all internal state
-   except for buffer locations set by `connect_port()`.  Since this plugin has
-   no other internal state, this method does nothing.
+   except for buffer locations set by `connect_port()`.
+
+   This plugin does all of its Julia setup here, where blocking is allowed:
+   it loads libjulia (or connects to the shared engine), includes amp.jl
+   unless this version of it already is, looks up and tests the functions
+   the configuration needs, compiles the Julia kernel, and opens the shared
+   tables.  It then picks the processing mode, resets the error state, scope
+   and watchdog, and warms up.  Any Julia failure latches the instance
+   instead of failing activation.
 
    This method is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -230,85 +1480,666 @@ activate(LV2_Handle instance)
 {
   Amp* self = (Amp*)instance;
 
-  // This is necessary for embedding to succeed
-  // see https://discourse.julialang.org/t/embedding-julia-without-rtld-global-in-dlopen/37655
-  printf("dlopen libjulia.so\n");
-  dlopen("libjulia.so", RTLD_NOW | RTLD_GLOBAL);
-
-
-  printf("Julia init\n");
-  Julia::run([] {jl_eval_string("println(\"Hello from Julia!)");});
-
-  jl_function_t* db_to_coef = Julia::run([] {
-      printf("Including amp.jl\n");
-      jl_module_t* julia_amp = (jl_module_t *)jl_eval_string(
-          "include(\"/home/oliver/local/src/lv2/plugins/eg-julia.amp.lv2/amp.jl\")"
-      );
-      if (jl_exception_occurred())
-        printf("E2: %s \n", jl_typeof_str(jl_exception_occurred()));
-      printf("Getting julia function\n");
-      jl_function_t* db_to_coef = jl_get_function(julia_amp, "db_to_coef");
-      if (jl_exception_occurred())
-        printf("E3: %s \n", jl_typeof_str(jl_exception_occurred()));
-      return db_to_coef;
-  });
-
-  printf("Saving julia function\n");
-  self->db_to_coef = db_to_coef;
-
-  float coef = Julia::run([&self] {
-      printf("Testing julia function.\n");
-      float gain = -3.0f;
-      jl_value_t* ret = jl_call1(self->db_to_coef, jl_box_float32(gain));
-      float unbox32;
-
-      if (jl_exception_occurred())
-        printf("E4: %s \n", jl_typeof_str(jl_exception_occurred()));
-      if (jl_typeis(ret, jl_float32_type)) {
-        unbox32 = jl_unbox_float32(ret);
+  // Failures and recoveries are logged from the audio thread
+  RtLog::start();
+
+  // Hashed once, so the engine and the shared tables agree on the version
+  char script[1024];
+  snprintf(script, sizeof(script), "%s/amp.jl", self->bundle_path);
+  if (!hash_file(script, &self->script_hash)) {
+    self->script_hash = 0;
+  }
+
+  self->error.latched.store(false);
+  self->error.failures = 0;
+  self->db_to_coef     = NULL;
+  self->julia_kernel   = NULL;
+  memset(&self->kernel_report, 0, sizeof(self->kernel_report));
+
+  if (!self->use_engine && !libjulia_open()) {
+    latch_error(self, "dlopen", "libjulia not found");
+  } else if (!self->use_engine) {
+    printf("Julia init\n");
+    Julia::run(JULIA_AMP_TASK_INIT, [] {jl_eval_string("println(\"Hello from Julia!\")");});
+  }
+
+  // Scratch is only allocated for optional features that are connected now
+  control_rate_free(&self->control);
+  if (self->connected & AMP_CONNECTED(AMP_GAIN_CV)) {
+    const char* k = getenv("JULIA_AMP_CONTROL_RATE");
+    uint32_t len = self->max_block_length ? self->max_block_length : 4096;
+    if (self->use_engine) {
+      len = std::min(len, (uint32_t)ENGINE_MAX_BLOCK);  // Control points must fit the channel
+    }
+    control_rate_init(&self->control, len, k ? (uint32_t)strtoul(k, NULL, 10) : 32);
+  }
+
+  float coef;
+  if (self->use_engine) {
+    coef = engine_open(self);
+  } else if (self->error.latched.load()) {
+    coef = NAN;
+  } else {
+    coef = Julia::run(JULIA_AMP_TASK_INCLUDE, [self] {
+        // Each version of the script is included once per process, so its
+        // module, and the kernels cached in it, survive later activations
+        char include[1280];
+        snprintf(include, sizeof(include),
+                 "let scripts = isdefined(Main, :julia_amp_scripts) ? Main.julia_amp_scripts :\n"
+                 "              (global julia_amp_scripts = Dict{UInt64,Module}())\n"
+                 "    get!(() -> include(raw\"%s/amp.jl\"), scripts, 0x%016llx)\n"
+                 "end",
+                 self->bundle_path, (unsigned long long)self->script_hash);
+
+        printf("Including amp.jl\n");
+        jl_module_t* julia_amp = (jl_module_t *)jl_eval_string(include);
+        if (julia_failed(self, "include")) {
+          return NAN;
+        }
+        printf("Getting julia function\n");
+        jl_function_t* db_to_coef = jl_get_function(julia_amp, "db_to_coef");
+        if (julia_failed(self, "lookup")) {
+          return NAN;
+        }
+        printf("Saving julia function\n");
+        self->db_to_coef = db_to_coef;
+
+        printf("Testing julia function.\n");
+        float gain = -3.0f;
+        jl_value_t* ret = jl_call1(self->db_to_coef, jl_box_float32(gain));
+        if (julia_failed(self, "activate", ret, true)) {
+          return NAN;
+        }
+        float unbox32 = jl_unbox_float32(ret);
         printf("Got32 gain=%.2f -> coef=%.2f\n", gain, unbox32);
+
+        // Let the script ccall our native kernels.  This is optional, so a
+        // failure here is reported but does not latch the instance.
+        char load[256];
+        snprintf(load, sizeof(load),
+                 "Main.julia_amp_scripts[0x%016llx].Native.load!(Ptr{Cvoid}(0x%llx), "
+                 "Ptr{Cvoid}(0x%llx), Ptr{Cvoid}(0x%llx))",
+                 (unsigned long long)self->script_hash,
+                 (unsigned long long)(uintptr_t)&julia_amp_gain,
+                 (unsigned long long)(uintptr_t)&julia_amp_ramp,
+                 (unsigned long long)(uintptr_t)&julia_amp_mix);
+        jl_eval_string(load);
+        if (jl_exception_occurred()) {
+          printf("Native kernels unavailable: %s\n", jl_typeof_str(jl_exception_occurred()));
+          jl_exception_clear();
+        }
+
+        if (self->control.audio || self->use_gain_table || self->watchdog.budget > 0.0f) {
+          self->control.fn = jl_get_function(julia_amp, "coefs!");
+          if (julia_failed(self, "lookup")) {
+            return NAN;
+          }
+        }
+
+        if (self->use_julia_curve) {
+          self->curve_fn = jl_get_function(julia_amp, "curve!");
+          if (julia_failed(self, "lookup")) {
+            return NAN;
+          }
+        }
+
+        if (self->use_julia_kernel) {
+          // Compiles (or reuses) the specialization for this configuration
+          char variant[128];
+          snprintf(variant, sizeof(variant), "julia_amp.variant(1, %u, 0x%08x)",
+                   self->block_length, self->sanitize ? 1u : 0u);
+          printf("Selecting Julia kernel %s\n", variant);
+          jl_value_t* kernel = jl_eval_string(variant);
+          if (!julia_failed(self, "variant")) {
+            self->julia_kernel = kernel;
+
+            // Optional, like the native kernels
+            jl_function_t* report = jl_get_function(julia_amp, "report!");
+            if (report) {
+              jl_call2(report, jl_box_voidpointer(&self->kernel_report), kernel);
+              if (jl_exception_occurred()) {
+                printf("Vectorization report unavailable: %s\n", jl_typeof_str(jl_exception_occurred()));
+                memset(&self->kernel_report, 0, sizeof(self->kernel_report));
+                jl_exception_clear();
+              }
+            }
+          }
+        }
         return unbox32;
-      } else {
-        printf("Received wrong type from julia.\n");
-        return -1.0f;
-      }
-  });
+    });
+  }
   printf("Test coef = %.2f\n", coef);
 
+  const bool kernel_loaded =
+      self->julia_kernel || (self->use_engine && self->use_julia_kernel && !self->error.latched.load());
+  if (kernel_loaded && !accept_kernel(self)) {
+    self->julia_kernel = NULL;
+  }
+
+  shared_table_close(&self->gain_table);
+  if ((self->use_gain_table || self->watchdog.budget > 0.0f) && !self->error.latched.load()) {
+    if (self->script_hash &&
+        shared_table_open(&self->gain_table, "gain", self->script_hash, AMP_GAIN_TABLE_COUNT,
+                          AMP_GAIN_TABLE_LO, AMP_GAIN_TABLE_STEP, build_gain_table, self)) {
+      printf("Gain table %s%s\n", self->gain_table.built ? "built" : "mapped",
+             self->gain_table.shared ? ", shared" : ", private");
+    }
+  }
+
+  self->compressor.curve = NULL;
+  shared_table_close(&self->curve_table);
+  if (self->use_julia_curve && self->use_engine) {
+    printf("The Julia compressor curve is not available with the engine\n");
+  } else if (self->use_julia_curve && !self->error.latched.load()) {
+    if (self->script_hash &&
+        shared_table_open(&self->curve_table, "curve", self->script_hash, COMPRESSOR_CURVE_COUNT,
+                          COMPRESSOR_CURVE_LO, COMPRESSOR_CURVE_STEP, build_curve_table, self)) {
+      self->compressor.curve = &self->curve_table;
+      printf("Compressor curve %s%s\n", self->curve_table.built ? "built" : "mapped",
+             self->curve_table.shared ? ", shared" : ", private");
+    }
+  }
+
+  if (!self->use_engine && libjulia.handle) {
+    Profiler::watchOnce();
+  }
+
+  if (self->use_gain_table && self->gain_table.values) {
+    self->top_mode = AMP_MODE_TABLE;
+  } else if (self->julia_kernel ||
+             (self->use_engine && self->use_julia_kernel && !self->kernel_report.refused)) {
+    self->top_mode = AMP_MODE_JULIA_KERNEL;
+  } else {
+    self->top_mode = AMP_MODE_NATIVE;
+  }
+  self->mode = self->top_mode;
+  watchdog_reset(&self->watchdog, self->watchdog.budget);
+  if (self->scope.ring) {
+    scope_reset(&self->scope);
+  }
+
+  const char* warmup = getenv("JULIA_AMP_WARMUP");
+  if (!self->error.latched.load()) {
+    warm_up(self, warmup ? (uint32_t)strtoul(warmup, NULL, 10) : 256);
+  }
+
+  if (self->engine.channel) {
+    // Activation may wait for the engine to compile, run() waits one block
+    const uint32_t longest = std::max(self->block_length, self->max_block_length);
+    engine_client_timeout(&self->engine, (uint32_t)(1e6 * longest / self->rate));
+  }
+
   printf("activate complete\n");
 
 }
 
+/**
+   Applies the gain to the first `n_samples` of the block.
+
+   Denormals are flushed for the duration of the call, on both the host thread
+   and the Julia worker.  A result from Julia that is not a finite Float32 is
+   never used as the coefficient: the last good coefficient is held instead.
+
+   Once Julia has failed, the instance is latched and no longer calls into
+   Julia.  At most one recovery probe per second is queued on the worker (or
+   sent to the shared engine), and only a successful probe unlatches the
+   instance.
+*/
+static void
+process(Amp* amp, uint32_t n_samples)
+{
+	ScopedDenormals denormals;
+
+	const float        gain   = *(amp->gain);
+	const float* const input  = amp->input;
+	float* const       output = amp->output;
+	float coef;
+	bool  processed = false;
+
+	if (amp->error.latched.load(std::memory_order_acquire)) {
+		coef = amp->fallback == AMP_FALLBACK_BYPASS ? 1.0f : amp->coef;
+
+		amp->samples_since_probe += n_samples;
+		if (amp->db_to_coef && amp->samples_since_probe >= amp->rate &&
+		    !amp->error.probing.exchange(true)) {
+			amp->samples_since_probe = 0;
+			Julia::post(JULIA_AMP_TASK_PROBE, [amp, gain] {
+				jl_value_t* ret = jl_call1(amp->db_to_coef, jl_box_float32(gain));
+				if (!jl_exception_occurred() && ret && jl_typeis(ret, jl_float32_type) &&
+				    is_finite(jl_unbox_float32(ret))) {
+					RtLog::push("julia-amp: Julia recovered after %.0f failures\n",
+					            amp->error.failures);
+					amp->error.latched.store(false, std::memory_order_release);
+				} else if (jl_exception_occurred()) {
+					jl_exception_clear();
+				}
+				amp->error.probing.store(false, std::memory_order_release);
+			});
+		} else if (amp->engine.channel && amp->samples_since_probe >= amp->rate) {
+			amp->samples_since_probe = 0;
+			if (is_finite(engine_run(amp, ENGINE_OP_COEF, 0, gain))) {
+				RtLog::push("julia-amp: Julia recovered after %.0f failures\n", amp->error.failures);
+				amp->error.latched.store(false, std::memory_order_release);
+			}
+		}
+	} else if (amp->mode == AMP_MODE_HOLD) {
+		coef = amp->coef;
+	} else if (amp->mode == AMP_MODE_TABLE) {
+		// The gain law comes from the table, Julia is not involved
+		coef = shared_table_lookup(&amp->gain_table, gain);
+		if (amp->control.audio && amp->gain_cv) {
+			for (uint32_t offset = 0; offset < n_samples; offset += amp->control.len) {
+				const uint32_t chunk = std::min(amp->control.len, n_samples - offset);
+				shared_table_lookup_block(&amp->gain_table, amp->control.audio, gain,
+				                          amp->gain_cv + offset, chunk);
+				if (amp->sanitize) {
+					apply_gains<true>(output + offset, input + offset, amp->control.audio, chunk);
+				} else {
+					apply_gains<false>(output + offset, input + offset, amp->control.audio, chunk);
+				}
+			}
+			processed = true;
+		}
+	} else if (amp->control.audio && amp->gain_cv) {
+		// The gain law is evaluated at control rate and applied per sample.
+		// An empty block runs no chunk and keeps the last coefficient.
+		coef = NAN;
+		for (uint32_t offset = 0; offset < n_samples; offset += amp->control.len) {
+			const uint32_t chunk = std::min(amp->control.len, n_samples - offset);
+			coef = control_rate_run(amp, amp->gain_cv + offset, chunk, gain);
+			if (!is_finite(coef)) {
+				break;
+			}
+			if (amp->sanitize) {
+				apply_gains<true>(output + offset, input + offset, amp->control.audio, chunk);
+			} else {
+				apply_gains<false>(output + offset, input + offset, amp->control.audio, chunk);
+			}
+		}
+		processed = is_finite(coef);
+	} else if (amp->mode == AMP_MODE_JULIA_KERNEL && amp->julia_kernel) {
+		amp->julia_block = {output, input, n_samples, gain};
+		coef = Julia::run(JULIA_AMP_TASK_BLOCK, [amp] {
+			ScopedDenormals denormals;
+			jl_value_t* ret = jl_call1(amp->julia_kernel, jl_box_voidpointer(&amp->julia_block));
+			if (julia_failed(amp, "process!", ret, true)) {
+				return NAN;
+			}
+			return jl_unbox_float32(ret);
+		});
+		processed = is_finite(coef);
+	} else if (amp->mode == AMP_MODE_JULIA_KERNEL && amp->engine.channel) {
+		coef      = engine_process(amp, output, input, n_samples, gain);
+		processed = is_finite(coef);
+	} else if (amp->engine.channel) {
+		coef = engine_run(amp, ENGINE_OP_COEF, 0, gain);
+	} else {
+		coef = Julia::run(JULIA_AMP_TASK_BLOCK, [amp, gain] {
+			ScopedDenormals denormals;
+			jl_value_t* ret = jl_call1(amp->db_to_coef, jl_box_float32(gain));
+			if (julia_failed(amp, "run", ret, true)) {
+				return NAN;
+			}
+			return jl_unbox_float32(ret);
+		});
+	}
+
+	if (is_finite(coef)) {
+		amp->coef = coef;
+	} else {
+		coef = amp->coef;
+	}
+
+	if (!processed) {
+		if (amp->sanitize) {
+			amp->kernel->sanitized(output, input, coef, n_samples);
+		} else {
+			amp->kernel->plain(output, input, coef, n_samples);
+		}
+	}
+
+	if (amp->compressing) {
+		if (amp->sanitize) {
+			compressor_process<true>(&amp->compressor, output, output, n_samples);
+		} else {
+			compressor_process<false>(&amp->compressor, output, output, n_samples);
+		}
+	}
+	if (amp->limiting) {
+		limiter_process(&amp->limiter, output, output, n_samples);
+	}
+}
+
+/** Reads every page of `buf`, so run() does not take the page faults. */
+static void
+prefault_read(const void* buf, size_t bytes)
+{
+	const volatile char* const p = (const volatile char*)buf;
+	for (size_t i = 0; i < bytes; i += 4096) {
+		(void)p[i];
+	}
+}
+
+/** Writes to every page of `buf`, so run() does not take the page faults. */
+static void
+prefault(void* buf, size_t bytes)
+{
+	volatile char* const p = (volatile char*)buf;
+	for (size_t i = 0; i < bytes; i += 4096) {
+		p[i] = p[i];
+	}
+	if (bytes) {
+		p[bytes - 1] = p[bytes - 1];
+	}
+}
+
+/**
+   Runs synthetic blocks of the host's block length through everything
+   `run()` may use: the Julia entry points selected for this configuration,
+   the native kernel, the limiter, the crossfade and the scope feed.  The
+   first real blocks then find the pages mapped, the caches and branch
+   predictors trained, and Julia's code compiled.
+
+   Blocks are timed in windows of `AMP_WARMUP_WINDOW`, and the warm-up ends
+   when the median of a window is within 10% of the one before, or after
+   `max_blocks` (JULIA_AMP_WARMUP, 256 by default, 0 disables it).  The port
+   buffers are left alone; scratch buffers stand in for them, and all state
+   the synthetic blocks touched is reset afterwards.
+*/
+static void
+warm_up(Amp* self, uint32_t max_blocks)
+{
+	typedef std::chrono::steady_clock clock;
+
+	if (!max_blocks) {
+		return;
+	}
+
+	const uint32_t n = self->max_block_length
+	                       ? std::min(self->block_length, self->max_block_length)
+	                       : self->block_length;
+	float* in  = (float*)calloc(n, sizeof(float));
+	float* out = (float*)calloc(n, sizeof(float));
+	float* cv  = (float*)calloc(n, sizeof(float));
+	LV2_Atom_Sequence* notify = (LV2_Atom_Sequence*)calloc(1, AMP_WARMUP_NOTIFY);
+	if (!in || !out || !cv || !notify) {
+		free(in);
+		free(out);
+		free(cv);
+		free(notify);
+		return;
+	}
+	for (uint32_t i = 0; i < n; ++i) {
+		in[i] = 2.0f * sinf(2.0f * (float)M_PI * 1000.0f * (float)i / (float)self->rate);
+		cv[i] = -6.0f * (float)i / (float)n;
+	}
+
+	// Per-instance buffers that run() writes
+	prefault(self->dry, sizeof(self->dry));
+	prefault(self->limiter.delay, self->limiter.capacity * sizeof(float));
+	prefault(self->limiter.dry, self->limiter.capacity * sizeof(float));
+	prefault(self->limiter.box, self->limiter.capacity * sizeof(float));
+	prefault(self->limiter.dq_time, self->limiter.capacity * sizeof(uint64_t));
+	prefault(self->limiter.dq_need, self->limiter.capacity * sizeof(float));
+	if (self->scope.ring) {
+		prefault(self->scope.ring, SCOPE_RING * sizeof(ScopeSummary));
+	}
+	if (self->gain_table.values) {
+		prefault_read(self->gain_table.values, self->gain_table.count * sizeof(float));
+	}
+	if (self->control.audio) {
+		const uint32_t n_points = self->control.len / self->control.k + 1;
+		prefault(self->control.audio, self->control.len * sizeof(float));
+		prefault(self->control.in, n_points * sizeof(float));
+		prefault(self->control.points, n_points * sizeof(float));
+	}
+
+	const float* const gain_port   = self->gain;
+	const float* const input_port  = self->input;
+	float* const       output_port = self->output;
+	const float* const cv_port     = self->gain_cv;
+	const float        gain        = 0.0f;
+	self->gain        = &gain;
+	self->input       = in;
+	self->output      = out;
+	self->gain_cv     = self->control.audio ? cv : NULL;
+	self->limiting    = true;
+	self->compressing = true;
+	limiter_reset(&self->limiter, self->limiter.capacity / 4 + 1, 0.5f, 0.999f);
+	compressor_set(&self->compressor, AMP_COMPRESSOR_THRESHOLD, AMP_COMPRESSOR_RATIO,
+	               AMP_COMPRESSOR_KNEE, AMP_COMPRESSOR_ATTACK, AMP_COMPRESSOR_RELEASE, self->rate);
+
+	double   window[AMP_WARMUP_WINDOW];
+	double   last_median = 0.0;
+	uint32_t blocks      = 0;
+	while (blocks < max_blocks && !self->error.latched.load()) {
+		const clock::time_point start = clock::now();
+		process(self, n);
+		if (self->julia_kernel || self->engine.channel || self->gain_cv) {
+			self->kernel->sanitized(out, in, 0.5f, n);  // The fallback when Julia fails
+		}
+		apply_crossfade(out, out, in, 0.0f, 1.0f, std::min(n, (uint32_t)AMP_BYPASS_FADE));
+		limiter_dry(&self->limiter, out, in, n);
+		if (self->scope.ring) {
+			scope_feed(&self->scope, out, n);
+			notify->atom.size = AMP_WARMUP_NOTIFY - sizeof(LV2_Atom);
+			scope_write(&self->scope, notify);
+		} else {
+			peak_abs(out, n);
+		}
+		window[blocks++ % AMP_WARMUP_WINDOW] =
+		    std::chrono::duration<double, std::micro>(clock::now() - start).count();
+
+		if (blocks % AMP_WARMUP_WINDOW == 0) {
+			std::sort(window, window + AMP_WARMUP_WINDOW);
+			const double median = window[AMP_WARMUP_WINDOW / 2];
+			if (last_median > 0.0 && fabs(median - last_median) <= 0.1 * last_median) {
+				break;
+			}
+			last_median = median;
+		}
+	}
+	printf("Warm-up: %u blocks of %u, %.1f us/block\n", blocks, n, last_median);
+
+	self->gain          = gain_port;
+	self->input         = input_port;
+	self->output        = output_port;
+	self->gain_cv       = cv_port;
+	self->limiting      = false;  // run() restarts the limiter when enabled
+	self->compressing   = false;  // and the compressor, with its own settings
+	memset(self->compressor_settings, 0, sizeof(self->compressor_settings));
+	self->coef          = 1.0f;
+	self->control.last  = NAN;
+	if (self->scope.ring) {
+		scope_reset(&self->scope);
+	}
+	free(in);
+	free(out);
+	free(cv);
+	free(notify);
+}
+
+/**
+   Reads the limiter ports.  Changing the lookahead (and so the latency)
+   restarts the limiter with an empty delay line; the ceiling changes in
+   place.
+*/
+static void
+update_limiter(Amp* amp)
+{
+	const bool limiting = amp->limit && *amp->limit > 0.0f;
+	const float lookahead = amp->lookahead
+	                            ? std::min(std::max(*amp->lookahead, 0.0f), (float)AMP_MAX_LOOKAHEAD_MS)
+	                            : 5.0f;
+	const float ceiling = powf(10.0f, 0.05f * (amp->ceiling ? std::min(*amp->ceiling, 0.0f) : -0.3f));
+
+	if (limiting && (!amp->limiting || lookahead != amp->limiter_lookahead)) {
+		limiter_reset(&amp->limiter,
+		              (uint32_t)(lookahead * 0.001f * amp->rate) + 1,
+		              ceiling,
+		              (float)exp(-1.0 / (AMP_LIMITER_RELEASE_MS * 0.001 * amp->rate)));
+		amp->limiter_lookahead = lookahead;
+	}
+	amp->limiter.ceiling = ceiling;
+	amp->limiting        = limiting;
+
+	if (amp->latency) {
+		*amp->latency = limiting ? (float)limiter_latency(&amp->limiter) : 0.0f;
+	}
+}
+
+/**
+   Reads the compressor ports.  The envelope restarts from no reduction when
+   the compressor is switched on; the coefficients are only recomputed when a
+   setting changes.
+*/
+static void
+update_compressor(Amp* amp)
+{
+	const bool  compressing = amp->compress && *amp->compress > 0.0f;
+	const float settings[5] = {
+		amp->threshold ? *amp->threshold : AMP_COMPRESSOR_THRESHOLD,
+		amp->ratio ? *amp->ratio : AMP_COMPRESSOR_RATIO,
+		amp->knee ? *amp->knee : AMP_COMPRESSOR_KNEE,
+		amp->attack ? *amp->attack : AMP_COMPRESSOR_ATTACK,
+		amp->release ? *amp->release : AMP_COMPRESSOR_RELEASE,
+	};
+
+	if (compressing && !amp->compressing) {
+		compressor_reset(&amp->compressor);
+	}
+	if (compressing && memcmp(settings, amp->compressor_settings, sizeof(settings))) {
+		compressor_set(&amp->compressor, settings[0], settings[1], settings[2], settings[3],
+		               settings[4], amp->rate);
+		memcpy(amp->compressor_settings, settings, sizeof(settings));
+	}
+	amp->compressing = compressing;
+}
+
+/**
+   Feeds the time `run()` took to the latency watchdog, and moves one mode
+   down or up when it says so.  The gain table is skipped if it could not be
+   built, and the watchdog never goes above the configured mode.
+*/
+static void
+watch_latency(Amp* amp, uint32_t n_samples, double seconds)
+{
+	const int step = watchdog_update(&amp->watchdog, seconds, n_samples / amp->rate);
+	if (!step) {
+		return;
+	}
+
+	int mode = (int)amp->mode - step;  // Cheaper modes come later
+	if (mode == AMP_MODE_TABLE && !amp->gain_table.values) {
+		mode -= step;
+	}
+	if (mode < (int)amp->top_mode || mode >= AMP_N_MODES) {
+		return;
+	}
+
+	RtLog::push("julia-amp: %s -> %s, p99 block time %.0f%% of the period, budget %.0f%%\n",
+	            amp_mode_names[amp->mode], amp_mode_names[mode],
+	            100.0 * amp->watchdog.p99, 100.0 * amp->watchdog.budget);
+	amp->mode         = (AmpMode)mode;
+	amp->control.last = NAN;  // The control ramp restarts from the new source
+	watchdog_stepped(&amp->watchdog, step);
+}
+
 /**
    The `run()` method is the main process function of the plugin.  It processes
    a block of audio in the audio context.  Since this plugin is
    `lv2:hardRTCapable`, `run()` must be real-time safe, so blocking (e.g. with
    a mutex) or memory allocation are not allowed.
+
+   While the `enabled` port is off, the input is passed through (or left in
+   place) without any processing or Julia interaction.  Switching between the
+   two crossfades over `AMP_BYPASS_FADE` samples.  When disabling, only the
+   fading part of the block is processed.  While the limiter is on, the dry
+   signal goes through a delay as long as its lookahead, so the latency
+   reported to the host holds while bypassed and the crossfade mixes aligned
+   signals.  Re-enabling primes the limiter from that delay at the last gain,
+   rather than replaying what it held before the bypass.
 */
 static void
 run(LV2_Handle instance, uint32_t n_samples)
 {
-	const Amp* amp = (const Amp*)instance;
+	typedef std::chrono::steady_clock clock;
 
-	const float        gain   = *(amp->gain);
-	const float* const input  = amp->input;
-	float* const       output = amp->output;
-	float coef;
+	Amp* amp = (Amp*)instance;
+
+	const bool              watched = amp->watchdog.budget > 0.0f && n_samples;
+	const clock::time_point start   = watched ? clock::now() : clock::time_point();
+
+	update_limiter(amp);
+	update_compressor(amp);
+
+	const bool enabled = !amp->enabled_port || *amp->enabled_port > 0.0f;
+	if (enabled != amp->enabled) {
+		// Reversing a fade half way continues from the current mix, and from
+		// the limiter's state, which the fade kept running
+		if (enabled && amp->limiting && amp->wet == 0.0f) {
+			limiter_prime(&amp->limiter, amp->coef);
+		}
+		amp->enabled        = enabled;
+		amp->fade_remaining = (uint32_t)(AMP_BYPASS_FADE * (enabled ? 1.0f - amp->wet : amp->wet) + 0.5f);
+	}
+
+	const uint32_t n_fade = std::min(n_samples, amp->fade_remaining);
+	if (enabled || n_fade) {
+		// In-place hosts overwrite the dry signal, so keep what the fade needs
+		if (amp->limiting) {
+			limiter_dry(&amp->limiter, amp->dry, amp->input, n_fade);
+			if (enabled) {
+				limiter_dry(&amp->limiter, NULL, amp->input + n_fade, n_samples - n_fade);
+			}
+		} else {
+			memcpy(amp->dry, amp->input, n_fade * sizeof(float));
+		}
+		process(amp, enabled ? n_samples : n_fade);
+	}
+	if (!enabled && amp->limiting) {
+		limiter_dry(&amp->limiter, amp->output + n_fade, amp->input + n_fade, n_samples - n_fade);
+	} else if (!enabled && amp->output != amp->input) {
+		memcpy(amp->output + n_fade, amp->input + n_fade, (n_samples - n_fade) * sizeof(float));
+	}
+
+	if (n_fade) {
+		const float to = std::min(1.0f, std::max(0.0f, amp->wet + (enabled ? 1.0f : -1.0f) *
+		                                                              (float)n_fade / AMP_BYPASS_FADE));
+		apply_crossfade(amp->output, amp->output, amp->dry, amp->wet, to, n_fade);
+		amp->wet            = amp->fade_remaining == n_fade ? (enabled ? 1.0f : 0.0f) : to;
+		amp->fade_remaining -= n_fade;
+	}
+
+	// The scope feed and the level meter share one pass over the output
+	const bool scoped = amp->scope.ring && (amp->connected & AMP_CONNECTED(AMP_NOTIFY));
+	if (scoped || (amp->connected & AMP_CONNECTED(AMP_LEVEL))) {
+		const float peak = scoped ? scope_feed(&amp->scope, amp->output, n_samples)
+		                          : peak_abs(amp->output, n_samples);
+		if (amp->connected & AMP_CONNECTED(AMP_LEVEL)) {
+			*amp->level = peak > 1e-5f ? 20.0f * log10f(peak) : -100.0f;
+		}
+	}
+	if (amp->connected & AMP_CONNECTED(AMP_NOTIFY)) {
+		scope_write(&amp->scope, amp->notify);
+	}
 
-  coef = Julia::run([amp, gain] {
-      float j_coef;
-      jl_value_t *ret = jl_call1(amp->db_to_coef, jl_box_float32(gain));
-      if (jl_typeis(ret, jl_float32_type)) {
-        j_coef = jl_unbox_float32(ret);
-      } else {
-        j_coef = -1;
-      }
-      return j_coef;
-  });
-  printf("coef = %.2f\n", coef);
+	if (watched) {
+		watch_latency(amp, n_samples, std::chrono::duration<double>(clock::now() - start).count());
+	}
+}
 
-	for (uint32_t pos = 0; pos < n_samples; pos++) {
-		output[pos] = input[pos] * coef;
+/**
+   Wait for a recovery probe queued by `run()`, which still refers to the
+   instance.  The worker does not run tasks in the order they were queued, so
+   this waits on the probe itself: clearing `probing` is the last thing it
+   does with the instance.
+*/
+static void
+wait_for_probe(Amp* amp)
+{
+	while (amp->error.probing.load(std::memory_order_acquire)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
 	}
 }
 
@@ -317,8 +2148,9 @@ run(LV2_Handle instance, uint32_t n_samples)
    the host after running the plugin.  It indicates that the host will not call
    `run()` again until another call to `activate()` and is mainly useful for more
    advanced plugins with ``live'' characteristics such as those with auxiliary
-   processing threads.  As with `activate()`, this plugin has no use for this
-   information so this method does nothing.
+   processing threads.  This plugin has one: a recovery probe queued on the
+   Julia worker by `run()` still refers to the instance, so this waits for
+   it to finish.
 
    This method is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -326,6 +2158,9 @@ run(LV2_Handle instance, uint32_t n_samples)
 static void
 deactivate(LV2_Handle instance)
 {
+	Amp* amp = (Amp*)instance;
+
+	wait_for_probe(amp);
 }
 
 /**
@@ -337,7 +2172,17 @@ deactivate(LV2_Handle instance)
 static void
 cleanup(LV2_Handle instance)
 {
-	free(instance);
+	Amp* amp = (Amp*)instance;
+
+	wait_for_probe(amp);
+	control_rate_free(&amp->control);
+	limiter_free(&amp->limiter);
+	shared_table_close(&amp->gain_table);
+	shared_table_close(&amp->curve_table);
+	scope_free(&amp->scope);
+	engine_client_close(&amp->engine);
+	free(amp->bundle_path);
+	free(amp);
 }
 
 /**
@@ -372,6 +2217,73 @@ static const LV2_Descriptor descriptor = {
 	extension_data
 };
 
+void
+julia_amp_gain(float* out, const float* in, float coef, uint32_t n)
+{
+	apply_gain_dispatch<false>(out, in, coef, n);
+}
+
+void
+julia_amp_ramp(float* out, const float* in, float from, float to, uint32_t n)
+{
+	apply_ramp<false>(out, in, from, to, n);
+}
+
+void
+julia_amp_mix(float* out, const float* a, float ga, const float* b, float gb, uint32_t n)
+{
+	apply_mix<false>(out, a, ga, b, gb, n);
+}
+
+void
+julia_amp_worker_eval(const char* code)
+{
+	if (!libjulia_open()) {
+		return;
+	}
+	const std::string source(code);
+	Julia::post(JULIA_AMP_TASK_EVAL, [source] {
+		jl_eval_string(source.c_str());
+		jl_exception_clear();
+	});
+}
+
+int
+julia_amp_worker_cpu(void)
+{
+	return Julia::run(JULIA_AMP_TASK_SYNC, [] { return sched_getcpu(); });
+}
+
+const char*
+julia_amp_task_kind_name(uint32_t kind)
+{
+	static const char* const names[JULIA_AMP_N_TASK_KINDS] = {
+		"init", "include", "block", "probe", "sync", "eval", "profile", "table"
+	};
+	return kind < JULIA_AMP_N_TASK_KINDS ? names[kind] : NULL;
+}
+
+int
+julia_amp_worker_metrics(uint32_t kind, JuliaAmpTaskMetrics* metrics)
+{
+	if (kind >= JULIA_AMP_N_TASK_KINDS) {
+		return -1;
+	}
+	Julia::metrics((JuliaAmpTaskKind)kind, metrics);
+	return 0;
+}
+
+int
+julia_amp_kernel_report(LV2_Handle instance, JuliaAmpKernelReport* report)
+{
+	const Amp* amp = (const Amp*)instance;
+	if (!amp || !amp->kernel_report.width) {
+		return -1;
+	}
+	*report = amp->kernel_report;
+	return 0;
+}
+
 /**
    The `lv2_descriptor()` function is the entry point to the plugin library.  The
    host will load the library and call this function repeatedly with increasing
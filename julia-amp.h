@@ -0,0 +1,105 @@
+#ifndef JULIA_AMP_H
+#define JULIA_AMP_H
+
+/**
+   Functions exported by julia-amp.so besides `lv2_descriptor()`, for Julia
+   scripts and for hosts that load the library directly (see bench.cpp).
+*/
+
+#include "lv2/core/lv2.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Native kernels for Julia scripts, see `julia_amp.Native` in amp.jl.
+   Buffers may alias (in-place is fine) and need no particular alignment.
+*/
+LV2_SYMBOL_EXPORT
+void julia_amp_gain(float* out, const float* in, float coef, uint32_t n);
+
+LV2_SYMBOL_EXPORT
+void julia_amp_ramp(float* out, const float* in, float from, float to, uint32_t n);
+
+LV2_SYMBOL_EXPORT
+void julia_amp_mix(float* out, const float* a, float ga, const float* b, float gb, uint32_t n);
+
+/**
+   Hooks for benchmark hosts, which use them to load the Julia worker the
+   way a busy script would.  `julia_amp_worker_eval()` queues `code` on the
+   worker without waiting for it; errors are discarded.
+   `julia_amp_worker_cpu()` returns the CPU the worker is running on.
+*/
+LV2_SYMBOL_EXPORT
+void julia_amp_worker_eval(const char* code);
+
+LV2_SYMBOL_EXPORT
+int julia_amp_worker_cpu(void);
+
+/** What a task on the Julia worker is for, given when it is submitted. */
+typedef enum {
+    JULIA_AMP_TASK_INIT,     // Starting and stopping the Julia runtime
+    JULIA_AMP_TASK_INCLUDE,  // Loading amp.jl and compiling kernels in activate()
+    JULIA_AMP_TASK_BLOCK,    // Coefficients or a kernel for one block of run()
+    JULIA_AMP_TASK_PROBE,    // Recovery probe while an instance is latched
+    JULIA_AMP_TASK_SYNC,     // A host thread waiting on the worker itself
+    JULIA_AMP_TASK_EVAL,     // Code from the host, julia_amp_worker_eval()
+    JULIA_AMP_TASK_PROFILE,  // Starting and saving an on-demand profile
+    JULIA_AMP_TASK_TABLE,    // Building a precomputed table
+    JULIA_AMP_N_TASK_KINDS
+} JuliaAmpTaskKind;
+
+/** Execution time buckets: [0, 1) µs, then [2^(i-1), 2^i) µs, the last one open. */
+#define JULIA_AMP_TASK_BUCKETS 24
+
+/** Totals for one task kind since the worker started, in nanoseconds. */
+typedef struct {
+    uint64_t count;
+    uint64_t wait_ns;      // Time queued before the worker picked the task up
+    uint64_t wait_max_ns;
+    uint64_t exec_ns;      // Time the task ran on the worker
+    uint64_t exec_max_ns;
+    uint64_t exec_hist[JULIA_AMP_TASK_BUCKETS];
+} JuliaAmpTaskMetrics;
+
+/** Name of a task kind, or NULL if `kind` is out of range. */
+LV2_SYMBOL_EXPORT
+const char* julia_amp_task_kind_name(uint32_t kind);
+
+/**
+   Copies the metrics of one task kind.  Safe to call from any thread at any
+   time; each field is read atomically, but not all of them at once.
+   Returns 0 on success and -1 if `kind` is out of range.
+*/
+LV2_SYMBOL_EXPORT
+int julia_amp_worker_metrics(uint32_t kind, JuliaAmpTaskMetrics* metrics);
+
+/**
+   What the Julia `process!` kernel of an instance (JULIA_AMP_JULIA_KERNEL=1)
+   compiled to on this CPU, from its optimized LLVM IR.  Filled in by
+   `julia_amp.report!` in amp.jl, which mirrors it.
+*/
+typedef struct {
+    int32_t width;         // Widest Float32 vector in the kernel, 1 if scalar
+    int32_t vectorized;    // 1 if the loop vectorizer ran on the block loop
+    int32_t boundschecks;  // Bounds checks left in the kernel
+    int32_t refused;       // 1 if JULIA_AMP_KERNEL_STRICT=1 refused a loop that did not vectorize
+} JuliaAmpKernelReport;
+
+/**
+   Copies the kernel report of an instance, as of its last `activate()`.
+   Returns 0 on success and -1 if the instance has no Julia kernel or its
+   report could not be made.  Must not be called concurrently with
+   `activate()`.
+*/
+LV2_SYMBOL_EXPORT
+int julia_amp_kernel_report(LV2_Handle instance, JuliaAmpKernelReport* report);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // JULIA_AMP_H
@@ -0,0 +1,917 @@
+/**
+   Offline renderer.
+
+   Runs the plugin over a headerless mono 32-bit float file and writes the
+   result in the same format, as fast as the storage allows.  Three I/O
+   backends are available:
+
+   - `uring`: io_uring with registered tile buffers.  Up to `depth` tiles are
+     in flight, so reads ahead of and writes behind the tile being processed
+     overlap with processing.
+   - `mmap`: both files mapped, processed straight from one map into the
+     other.  The kernel does read-ahead, but page faults stall processing.
+   - `pread`: one tile at a time, read, process, write.  No overlap.
+
+   `uring` falls back to `mmap` if io_uring is not available (old kernel,
+   seccomp), and `mmap` falls back to `pread` for files that cannot be mapped.
+
+   With `-c`, each tile's output is kept in a cache directory, and a later
+   render only processes the tiles whose input or settings changed (see
+   `render_cached()`).
+
+   With `-s`, the input is rendered with every parameter set of a sweep file
+   in a single pass, one output file per set (see `render_sweep()`):
+
+     render [options] -s SWEEP IN
+
+   Usage: ./render [options] IN OUT
+
+     -B DIR          Bundle directory with julia-amp.so and amp.jl (.)
+     -g DB           Value of the gain port (0)
+     -p INDEX=VALUE  Connect control input port INDEX with a fixed value
+     -b N            Samples per run() call (256)
+     -i BACKEND      uring, mmap or pread (uring)
+     -t N            Samples per I/O tile (65536)
+     -q N            Tiles in flight with io_uring (8)
+     -c DIR          Reuse unchanged tiles from the cache in DIR, pread I/O
+     -m MS           Plugin memory assumed by the cache, in ms (1000)
+     -s FILE         Sweep file, one `OUT DB [INDEX=VALUE]...` set per line
+*/
+
+#include "lv2/core/lv2.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "amp-kernels.hpp"
+#include "amp-table.hpp"
+
+#define RENDER_MAX_PORTS 32
+#define RENDER_MAX_SETS  256
+
+/** One plugin instance with every port connected. */
+typedef struct {
+    void*                 lib;
+    const LV2_Descriptor* desc;
+    LV2_Handle            handle;
+    uint32_t              block;
+    float                 controls[RENDER_MAX_PORTS];
+    bool                  connected[RENDER_MAX_PORTS];
+} Plugin;
+
+typedef struct {
+    const char* bundle;
+    const char* backend;
+    const char* cache;  // Cache directory, or NULL
+    const char* sweep;  // Sweep file, or NULL
+    double      rate;
+    uint32_t    block;
+    uint32_t    tile;
+    uint32_t    depth;
+    uint32_t    memory_ms;
+    uint32_t    n_ports;
+    uint32_t    port_index[RENDER_MAX_PORTS];
+    float       port_value[RENDER_MAX_PORTS];
+} Options;
+
+static bool
+plugin_open(Plugin* plugin, const Options* opts, double rate)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/julia-amp.so", opts->bundle);
+
+    memset(plugin, 0, sizeof(Plugin));
+    plugin->block = opts->block;
+    plugin->lib   = dlopen(path, RTLD_NOW);
+    if (!plugin->lib) {
+        fprintf(stderr, "render: %s\n", dlerror());
+        return false;
+    }
+
+    typedef const LV2_Descriptor* (*DescriptorFunc)(uint32_t);
+    DescriptorFunc lv2_descriptor = (DescriptorFunc)dlsym(plugin->lib, "lv2_descriptor");
+    plugin->desc = lv2_descriptor ? lv2_descriptor(0) : NULL;
+    plugin->handle = plugin->desc ? plugin->desc->instantiate(plugin->desc, rate, opts->bundle, NULL) : NULL;
+    if (!plugin->handle) {
+        fprintf(stderr, "render: failed to instantiate %s\n", path);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < opts->n_ports; ++i) {
+        const uint32_t index      = opts->port_index[i];
+        plugin->controls[index]   = opts->port_value[i];
+        plugin->connected[index]  = true;
+    }
+    for (uint32_t index = 0; index < RENDER_MAX_PORTS; ++index) {
+        if (plugin->connected[index]) {
+            plugin->desc->connect_port(plugin->handle, index, &plugin->controls[index]);
+        }
+    }
+    plugin->desc->activate(plugin->handle);
+    return true;
+}
+
+static void
+plugin_close(Plugin* plugin)
+{
+    if (plugin->handle) {
+        plugin->desc->deactivate(plugin->handle);
+        plugin->desc->cleanup(plugin->handle);
+    }
+    if (plugin->lib) {
+        dlclose(plugin->lib);
+    }
+}
+
+/** Processes `n` samples in blocks of at most `plugin->block`. */
+static void
+plugin_process(Plugin* plugin, float* out, const float* in, size_t n)
+{
+    for (size_t offset = 0; offset < n; offset += plugin->block) {
+        const uint32_t len = (uint32_t)(n - offset < plugin->block ? n - offset : plugin->block);
+        plugin->desc->connect_port(plugin->handle, 1, (void*)(in + offset));
+        plugin->desc->connect_port(plugin->handle, 2, out + offset);
+        plugin->desc->run(plugin->handle, len);
+    }
+}
+
+/* pread backend */
+
+static bool
+full_pread(int fd, void* buf, size_t len, off_t offset)
+{
+    for (size_t done = 0; done < len;) {
+        const ssize_t r = pread(fd, (char*)buf + done, len - done, offset + done);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += r;
+    }
+    return true;
+}
+
+static bool
+full_pwrite(int fd, const void* buf, size_t len, off_t offset)
+{
+    for (size_t done = 0; done < len;) {
+        const ssize_t r = pwrite(fd, (const char*)buf + done, len - done, offset + done);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += r;
+    }
+    return true;
+}
+
+static bool
+render_pread(Plugin* plugin, int in_fd, int out_fd, size_t n, const Options* opts)
+{
+    float* buf = (float*)malloc(opts->tile * sizeof(float));
+    bool   ok  = buf != NULL;
+    for (size_t offset = 0; ok && offset < n; offset += opts->tile) {
+        const size_t len = n - offset < opts->tile ? n - offset : opts->tile;
+        ok = full_pread(in_fd, buf, len * sizeof(float), offset * sizeof(float));
+        if (ok) {
+            plugin_process(plugin, buf, buf, len);
+            ok = full_pwrite(out_fd, buf, len * sizeof(float), offset * sizeof(float));
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+/* mmap backend */
+
+static bool
+render_mmap(Plugin* plugin, int in_fd, int out_fd, size_t n, const Options* opts)
+{
+    const size_t bytes = n * sizeof(float);
+    if (!bytes) {
+        return true;
+    }
+    if (ftruncate(out_fd, bytes)) {
+        return false;
+    }
+
+    void* in  = mmap(NULL, bytes, PROT_READ, MAP_SHARED, in_fd, 0);
+    void* out = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    if (in == MAP_FAILED || out == MAP_FAILED) {
+        if (in != MAP_FAILED) {
+            munmap(in, bytes);
+        }
+        if (out != MAP_FAILED) {
+            munmap(out, bytes);
+        }
+        fprintf(stderr, "render: mmap failed, using pread\n");
+        return render_pread(plugin, in_fd, out_fd, n, opts);
+    }
+    madvise(in, bytes, MADV_SEQUENTIAL);
+    madvise(out, bytes, MADV_SEQUENTIAL);
+
+    for (size_t offset = 0; offset < n; offset += opts->tile) {
+        const size_t len = n - offset < opts->tile ? n - offset : opts->tile;
+        plugin_process(plugin, (float*)out + offset, (const float*)in + offset, len);
+    }
+
+    munmap(in, bytes);
+    munmap(out, bytes);
+    return true;
+}
+
+/* Incremental cache */
+
+extern char** environ;
+
+/**
+   Hash of everything but the input that a tile's output depends on: the
+   port values, the block and tile lengths, the assumed memory, amp.jl,
+   julia-amp.so, and every JULIA_AMP_* variable.
+*/
+static uint64_t
+cache_base_key(const Options* opts)
+{
+    uint64_t key = 0xCBF29CE484222325ull;
+    char     path[1024];
+    uint64_t file = 0;
+
+    snprintf(path, sizeof(path), "%s/amp.jl", opts->bundle);
+    key = fnv1a(key, &file, hash_file(path, &file) ? sizeof(file) : 0);
+    snprintf(path, sizeof(path), "%s/julia-amp.so", opts->bundle);
+    key = fnv1a(key, &file, hash_file(path, &file) ? sizeof(file) : 0);
+
+    key = fnv1a(key, &opts->rate, sizeof(opts->rate));
+    key = fnv1a(key, &opts->block, sizeof(opts->block));
+    key = fnv1a(key, &opts->tile, sizeof(opts->tile));
+    key = fnv1a(key, &opts->memory_ms, sizeof(opts->memory_ms));
+    key = fnv1a(key, opts->port_index, opts->n_ports * sizeof(opts->port_index[0]));
+    key = fnv1a(key, opts->port_value, opts->n_ports * sizeof(opts->port_value[0]));
+
+    std::vector<const char*> vars;
+    for (char** var = environ; *var; ++var) {
+        if (!strncmp(*var, "JULIA_AMP_", 10)) {
+            vars.push_back(*var);
+        }
+    }
+    std::sort(vars.begin(), vars.end(),
+              [](const char* a, const char* b) { return strcmp(a, b) < 0; });
+    for (const char* var : vars) {
+        key = fnv1a(key, var, strlen(var) + 1);
+    }
+    return key;
+}
+
+static bool
+cache_load(const char* path, float* out, size_t n)
+{
+    const int   fd = open(path, O_RDONLY);
+    struct stat st;
+    const bool  ok = fd >= 0 && !fstat(fd, &st) && (size_t)st.st_size == n * sizeof(float) &&
+                    full_pread(fd, out, n * sizeof(float), 0);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+/** Writes an entry under a temporary name first, so readers never see half of it. */
+static bool
+cache_store(const char* path, const float* data, size_t n)
+{
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    const bool ok = full_pwrite(fd, data, n * sizeof(float), 0) && !close(fd) && !rename(tmp, path);
+    if (!ok) {
+        unlink(tmp);
+    }
+    return ok;
+}
+
+/**
+   Re-renders only the tiles whose output can have changed.  The output of
+   each tile is cached under a hash of its input, of the `memory_ms` of
+   input before it, and of `cache_base_key()`.
+
+   The plugin has state, so a tile's output depends on all the input before
+   it.  The cache assumes that the state only depends on the last
+   `memory_ms` of input.  Tiles are processed in order.  A tile that
+   follows a rendered one continues from the real state, so with an empty
+   cache this is a plain render.  A tile that follows a cached one starts
+   from a state primed by running that stretch of input through the plugin
+   first.  For the gain law, the primed state is exact.  The limiter and
+   compressor envelopes forget the input before it only as fast as they
+   decay, so set `-m` to a few of their release times.
+*/
+static bool
+render_cached(Plugin* plugin, int in_fd, int out_fd, size_t n, const Options* opts)
+{
+    if (mkdir(opts->cache, 0755) && errno != EEXIST) {
+        fprintf(stderr, "render: cannot create %s: %s\n", opts->cache, strerror(errno));
+        return false;
+    }
+
+    const uint64_t base    = cache_base_key(opts);
+    const size_t   memory  = (size_t)(opts->memory_ms * 0.001 * opts->rate);
+    float*         buf     = (float*)malloc((memory + opts->tile) * sizeof(float));
+    bool           ok      = buf != NULL;
+    bool           primed  = true;  // The plugin state follows on from the previous tile
+    size_t         reused  = 0;
+    size_t         n_tiles = 0;
+    for (size_t offset = 0; ok && offset < n; offset += opts->tile, ++n_tiles) {
+        const size_t len     = n - offset < opts->tile ? n - offset : opts->tile;
+        const size_t context = offset < memory ? offset : memory;
+        float* const tile    = buf + context;
+        ok = full_pread(in_fd, buf, (context + len) * sizeof(float), (offset - context) * sizeof(float));
+        if (!ok) {
+            break;
+        }
+
+        char           path[1024];
+        const uint64_t key = fnv1a(fnv1a(base, &context, sizeof(context)), buf,
+                                   (context + len) * sizeof(float));
+        snprintf(path, sizeof(path), "%s/%016llx.f32", opts->cache, (unsigned long long)key);
+        if (cache_load(path, tile, len)) {
+            ++reused;
+            primed = false;
+        } else {
+            if (!primed) {
+                plugin_process(plugin, buf, buf, context);
+            }
+            plugin_process(plugin, tile, tile, len);
+            primed = true;
+            if (!cache_store(path, tile, len)) {
+                fprintf(stderr, "render: cannot write %s: %s\n", path, strerror(errno));
+            }
+        }
+        ok = full_pwrite(out_fd, tile, len * sizeof(float), offset * sizeof(float));
+    }
+    free(buf);
+
+    fprintf(stderr, "render: %zu of %zu tiles from the cache\n", reused, n_tiles);
+    return ok;
+}
+
+/* io_uring backend, on raw system calls so there is no liburing dependency */
+
+typedef struct {
+    int fd;
+
+    unsigned*             sq_head;
+    unsigned*             sq_tail;
+    unsigned*             sq_mask;
+    unsigned*             sq_array;
+    struct io_uring_sqe*  sqes;
+    unsigned*             cq_head;
+    unsigned*             cq_tail;
+    unsigned*             cq_mask;
+    struct io_uring_cqe*  cqes;
+
+    void*  sq_ring;
+    size_t sq_ring_size;
+    void*  cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+static bool
+uring_init(Uring* ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(Uring));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = ring->cq_ring_size = (ring->sq_ring_size > ring->cq_ring_size)
+                                                      ? ring->sq_ring_size
+                                                      : ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+                        ? ring->sq_ring
+                        : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+
+    char* sq = (char*)ring->sq_ring;
+    char* cq = (char*)ring->cq_ring;
+    ring->sq_head  = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void
+uring_free(Uring* ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/** Queues a fixed-buffer read or write, submitted by the next uring_wait(). */
+static void
+uring_queue(Uring* ring, uint8_t op, int fd, void* buf, unsigned len, uint64_t offset,
+            uint16_t buf_index, uint64_t user_data)
+{
+    const unsigned tail  = __atomic_load_n(ring->sq_tail, __ATOMIC_RELAXED);
+    const unsigned index = tail & *ring->sq_mask;
+
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)buf;
+    sqe->len       = len;
+    sqe->off       = offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/** Submits queued requests and waits for at least one completion. */
+static bool
+uring_wait(Uring* ring, unsigned to_submit, uint64_t* user_data, int* res)
+{
+    for (;;) {
+        const unsigned head = __atomic_load_n(ring->cq_head, __ATOMIC_RELAXED);
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) && !to_submit) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            *user_data                     = cqe->user_data;
+            *res                           = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        const long r = syscall(__NR_io_uring_enter, ring->fd, to_submit, to_submit ? 0 : 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno != EINTR) {
+            return false;
+        }
+        if (r > 0) {
+            to_submit -= (unsigned)r;
+        }
+    }
+}
+
+typedef enum { TILE_FREE, TILE_READING, TILE_READY, TILE_WRITING } TileState;
+
+typedef struct {
+    TileState state;
+    size_t    index;  // Tile number in the file
+    unsigned  len;    // Bytes in this tile
+    unsigned  done;   // Bytes transferred so far
+} Tile;
+
+/**
+   Keeps `depth` registered tile buffers in flight.  Tiles are processed
+   strictly in order, since the plugin has state, while reads of later tiles
+   and writes of earlier ones proceed in the background.
+*/
+static bool
+render_uring(Plugin* plugin, int in_fd, int out_fd, size_t n, const Options* opts)
+{
+    Uring ring;
+    if (!uring_init(&ring, opts->depth * 2)) {
+        fprintf(stderr, "render: io_uring unavailable (%s), using mmap\n", strerror(errno));
+        return render_mmap(plugin, in_fd, out_fd, n, opts);
+    }
+
+    const size_t tile_bytes = (size_t)opts->tile * sizeof(float);
+    const size_t n_tiles    = (n + opts->tile - 1) / opts->tile;
+    const size_t total      = n * sizeof(float);
+
+    float*        pool  = (float*)mmap(NULL, tile_bytes * opts->depth, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    Tile*         tiles = (Tile*)calloc(opts->depth, sizeof(Tile));
+    struct iovec* iov   = (struct iovec*)calloc(opts->depth, sizeof(struct iovec));
+    if (pool == MAP_FAILED || !tiles || !iov) {
+        uring_free(&ring);
+        return false;
+    }
+    for (uint32_t i = 0; i < opts->depth; ++i) {
+        iov[i].iov_base = (char*)pool + i * tile_bytes;
+        iov[i].iov_len  = tile_bytes;
+    }
+    // Registered buffers are pinned once instead of on every request
+    const bool fixed = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                               iov, opts->depth) == 0;
+
+    size_t   next_read    = 0;  // Next tile to read
+    size_t   next_process = 0;  // Next tile to process
+    size_t   written      = 0;  // Tiles completely written
+    unsigned queued       = 0;
+    bool     ok           = true;
+
+    while (ok && written < n_tiles) {
+        // Read ahead into every free buffer
+        for (uint32_t i = 0; i < opts->depth && next_read < n_tiles; ++i) {
+            if (tiles[i].state == TILE_FREE) {
+                const size_t offset = next_read * tile_bytes;
+                tiles[i].state = TILE_READING;
+                tiles[i].index = next_read++;
+                tiles[i].len   = (unsigned)(total - offset < tile_bytes ? total - offset : tile_bytes);
+                tiles[i].done  = 0;
+                uring_queue(&ring, fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, in_fd,
+                            iov[i].iov_base, tiles[i].len, offset, (uint16_t)i, i);
+                ++queued;
+            }
+        }
+
+        // Process the next tile as soon as it is in, then write it behind
+        bool progressed = false;
+        for (uint32_t i = 0; i < opts->depth; ++i) {
+            if (tiles[i].state == TILE_READY && tiles[i].index == next_process) {
+                float* buf = (float*)iov[i].iov_base;
+                plugin_process(plugin, buf, buf, tiles[i].len / sizeof(float));
+                tiles[i].state = TILE_WRITING;
+                tiles[i].done  = 0;
+                uring_queue(&ring, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, out_fd,
+                            buf, tiles[i].len, tiles[i].index * tile_bytes, (uint16_t)i, i);
+                ++queued;
+                ++next_process;
+                progressed = true;
+            }
+        }
+        if (progressed) {
+            continue;  // Submit the write together with any new reads
+        }
+
+        uint64_t i   = 0;
+        int      res = 0;
+        if (!uring_wait(&ring, queued, &i, &res)) {
+            ok = false;
+            break;
+        }
+        queued = 0;
+        if (res <= 0) {
+            fprintf(stderr, "render: I/O error: %s\n", strerror(res ? -res : EIO));
+            ok = false;
+            break;
+        }
+
+        // Finish short transfers with a follow-up request on the same buffer
+        Tile* tile = &tiles[i];
+        tile->done += (unsigned)res;
+        if (tile->done < tile->len) {
+            const bool reading = tile->state == TILE_READING;
+            uring_queue(&ring,
+                        reading ? IORING_OP_READ : IORING_OP_WRITE,
+                        reading ? in_fd : out_fd,
+                        (char*)iov[i].iov_base + tile->done,
+                        tile->len - tile->done,
+                        tile->index * tile_bytes + tile->done,
+                        0,
+                        i);
+            queued = 1;
+        } else if (tile->state == TILE_READING) {
+            tile->state = TILE_READY;
+        } else {
+            tile->state = TILE_FREE;
+            ++written;
+        }
+    }
+
+    free(iov);
+    free(tiles);
+    munmap(pool, tile_bytes * opts->depth);
+    uring_free(&ring);
+    return ok;
+}
+
+/* Parameter sweep */
+
+/** One line of a sweep file, rendered by its own instance. */
+typedef struct {
+    char    path[1024];
+    Options opts;  // The global options, with this set's gain and ports
+    Plugin  plugin;
+    int     fd;
+    float*  out;   // One tile
+    float   coef;  // The gain as a factor, for gain-only sweeps
+} SweepSet;
+
+/**
+   Reads a sweep file.  Each line is `OUT DB [INDEX=VALUE]...`: the output
+   file, the gain, and ports to connect on top of the `-p` ones.  Blank
+   lines and lines starting with `#` are skipped.  Returns the number of
+   sets, or -1 on error.
+*/
+static int
+sweep_parse(SweepSet* sets, const Options* opts)
+{
+    FILE* file = fopen(opts->sweep, "r");
+    if (!file) {
+        fprintf(stderr, "render: %s: %s\n", opts->sweep, strerror(errno));
+        return -1;
+    }
+
+    char line[4096];
+    int  n_sets = 0;
+    for (int lineno = 1; fgets(line, sizeof(line), file); ++lineno) {
+        char* save = NULL;
+        char* path = strtok_r(line, " \t\r\n", &save);
+        if (!path || path[0] == '#') {
+            continue;
+        }
+        char* gain = strtok_r(NULL, " \t\r\n", &save);
+        if (!gain || n_sets == RENDER_MAX_SETS) {
+            fprintf(stderr, "render: %s:%d: %s\n", opts->sweep, lineno,
+                    gain ? "too many sets" : "expected OUT DB");
+            fclose(file);
+            return -1;
+        }
+
+        SweepSet* set = &sets[n_sets++];
+        memset(set, 0, sizeof(SweepSet));
+        snprintf(set->path, sizeof(set->path), "%s", path);
+        set->opts               = *opts;
+        set->opts.port_value[0] = strtof(gain, NULL);
+        set->fd                 = -1;
+        for (char* port; (port = strtok_r(NULL, " \t\r\n", &save));) {
+            const char*    eq    = strchr(port, '=');
+            const uint32_t index = (uint32_t)strtoul(port, NULL, 10);
+            if (!eq || index == 1 || index == 2 || index >= RENDER_MAX_PORTS ||
+                set->opts.n_ports == RENDER_MAX_PORTS) {
+                fprintf(stderr, "render: %s:%d: bad port %s\n", opts->sweep, lineno, port);
+                fclose(file);
+                return -1;
+            }
+            set->opts.port_index[set->opts.n_ports]   = index;
+            set->opts.port_value[set->opts.n_ports++] = strtof(eq + 1, NULL);
+        }
+    }
+    fclose(file);
+    return n_sets;
+}
+
+/**
+   The gain of an instance as a factor, from its output for a block of ones.
+   Only meaningful if it does nothing but scale its input.
+*/
+static float
+plugin_probe_gain(Plugin* plugin)
+{
+    std::vector<float> ones(plugin->block, 1.0f);
+    std::vector<float> out(plugin->block, 0.0f);
+    plugin_process(plugin, out.data(), ones.data(), plugin->block);
+    return out[plugin->block - 1];
+}
+
+/**
+   Renders every set of a sweep in one pass over the input.  Each tile is
+   read once.  If the sets only differ in gain, with no other port connected,
+   each instance only scales its input, so the instances are only used to
+   get their coefficients from the gain law.  All outputs are then computed
+   by `apply_gain_sweep()`, which loads each vector of the input once for all
+   the sets.  Otherwise each instance processes the tile from memory.
+*/
+static bool
+render_sweep(SweepSet* sets, uint32_t n_sets, int in_fd, size_t n, const Options* opts)
+{
+    bool gain_only = opts->n_ports == 1;
+    for (uint32_t k = 0; k < n_sets; ++k) {
+        gain_only = gain_only && sets[k].opts.n_ports == 1;
+    }
+
+    const char*        sanitize_env = getenv("JULIA_AMP_SANITIZE");
+    const bool         sanitize     = !sanitize_env || strcmp(sanitize_env, "0") != 0;
+    std::vector<float> coefs(n_sets);
+    std::vector<float*> outs(n_sets);
+    for (uint32_t k = 0; k < n_sets; ++k) {
+        outs[k]  = sets[k].out;
+        coefs[k] = gain_only ? plugin_probe_gain(&sets[k].plugin) : 0.0f;
+    }
+
+    float* in = (float*)malloc(opts->tile * sizeof(float));
+    bool   ok = in != NULL;
+    for (size_t offset = 0; ok && offset < n; offset += opts->tile) {
+        const size_t len = n - offset < opts->tile ? n - offset : opts->tile;
+        ok = full_pread(in_fd, in, len * sizeof(float), offset * sizeof(float));
+        if (!ok) {
+            break;
+        }
+
+        if (gain_only && sanitize) {
+            apply_gain_sweep<true>(outs.data(), in, coefs.data(), n_sets, (uint32_t)len);
+        } else if (gain_only) {
+            apply_gain_sweep<false>(outs.data(), in, coefs.data(), n_sets, (uint32_t)len);
+        } else {
+            for (uint32_t k = 0; k < n_sets; ++k) {
+                plugin_process(&sets[k].plugin, outs[k], in, len);
+            }
+        }
+
+        for (uint32_t k = 0; ok && k < n_sets; ++k) {
+            ok = full_pwrite(sets[k].fd, outs[k], len * sizeof(float), offset * sizeof(float));
+        }
+    }
+    free(in);
+
+    fprintf(stderr, "render: %u sets, %s\n", n_sets,
+            gain_only ? "gain only, one kernel for all" : "one instance each");
+    return ok;
+}
+
+/** `render -s`: an instance and an output file per set, then one pass. */
+static int
+sweep(const Options* opts, const char* in_path)
+{
+    std::vector<SweepSet> sets(RENDER_MAX_SETS);
+    const int             n_sets = sweep_parse(sets.data(), opts);
+    if (n_sets <= 0) {
+        fprintf(stderr, "render: no sets in %s\n", opts->sweep);
+        return 1;
+    }
+
+    const int   in_fd = open(in_path, O_RDONLY);
+    struct stat st;
+    bool        ok = in_fd >= 0 && !fstat(in_fd, &st);
+    if (!ok) {
+        fprintf(stderr, "render: %s: %s\n", in_path, strerror(errno));
+    }
+    for (int k = 0; ok && k < n_sets; ++k) {
+        SweepSet* set = &sets[k];
+        set->fd       = open(set->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        set->out      = (float*)malloc(opts->tile * sizeof(float));
+        if (set->fd < 0 || !set->out) {
+            fprintf(stderr, "render: %s: %s\n", set->path, strerror(errno));
+            ok = false;
+        } else {
+            ok = plugin_open(&set->plugin, &set->opts, opts->rate);
+        }
+    }
+
+    if (ok) {
+        typedef std::chrono::steady_clock clock;
+        const clock::time_point start = clock::now();
+        const size_t            n     = (size_t)st.st_size / sizeof(float);
+
+        ok = render_sweep(sets.data(), (uint32_t)n_sets, in_fd, n, opts);
+        for (int k = 0; ok && k < n_sets; ++k) {
+            ok = fdatasync(sets[k].fd) == 0;
+        }
+
+        const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+        fprintf(stderr, "render: sweep: %zu samples x %d sets in %.3f s, %.1f MB/s in, %.1fx real time\n",
+                n, n_sets, seconds, n * sizeof(float) / seconds / 1e6, n_sets * n / opts->rate / seconds);
+    }
+
+    for (int k = 0; k < n_sets; ++k) {
+        plugin_close(&sets[k].plugin);
+        free(sets[k].out);
+        if (sets[k].fd >= 0) {
+            close(sets[k].fd);
+        }
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    return ok ? 0 : 1;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: render [-B DIR] [-g DB] [-p INDEX=VALUE]... [-b N]\n"
+            "              [-i uring|mmap|pread] [-t N] [-q N] [-c DIR] [-m MS] IN OUT\n"
+            "       render [options] -s SWEEP IN\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    Options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.bundle    = ".";
+    opts.backend   = "uring";
+    opts.rate      = 48000.0;
+    opts.block     = 256;
+    opts.tile      = 65536;
+    opts.depth     = 8;
+    opts.n_ports   = 1;  // Gain
+    opts.memory_ms = 1000;
+
+    int c;
+    while ((c = getopt(argc, argv, "B:g:p:b:i:t:q:c:m:s:h")) != -1) {
+        switch (c) {
+        case 'B': opts.bundle = optarg; break;
+        case 'g': opts.port_value[0] = strtof(optarg, NULL); break;
+        case 'p': {
+            char*          eq    = strchr(optarg, '=');
+            const uint32_t index = (uint32_t)strtoul(optarg, NULL, 10);
+            if (!eq || index == 1 || index == 2 || index >= RENDER_MAX_PORTS ||
+                opts.n_ports == RENDER_MAX_PORTS) {
+                usage();
+                return 1;
+            }
+            opts.port_index[opts.n_ports]   = index;
+            opts.port_value[opts.n_ports++] = strtof(eq + 1, NULL);
+            break;
+        }
+        case 'b': opts.block = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'i': opts.backend = optarg; break;
+        case 't': opts.tile = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'q': opts.depth = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'c': opts.cache = optarg; break;
+        case 'm': opts.memory_ms = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 's': opts.sweep = optarg; break;
+        default: usage(); return c == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.sweep && !opts.cache && argc - optind == 1 && opts.block && opts.tile) {
+        return sweep(&opts, argv[optind]);
+    } else if (opts.sweep || argc - optind != 2 || !opts.block || !opts.tile || !opts.depth || opts.depth > 1024) {
+        usage();
+        return 1;
+    }
+
+    const int in_fd  = open(argv[optind], O_RDONLY);
+    const int out_fd = open(argv[optind + 1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    if (in_fd < 0 || out_fd < 0 || fstat(in_fd, &st)) {
+        fprintf(stderr, "render: %s\n", strerror(errno));
+        return 1;
+    }
+    const size_t n = (size_t)st.st_size / sizeof(float);
+
+    Plugin plugin;
+    if (!plugin_open(&plugin, &opts, opts.rate)) {
+        return 1;
+    }
+
+    typedef std::chrono::steady_clock clock;
+    const clock::time_point start = clock::now();
+
+    bool ok;
+    if (opts.cache) {
+        opts.backend = "cache";
+        ok           = render_cached(&plugin, in_fd, out_fd, n, &opts);
+    } else if (!strcmp(opts.backend, "pread")) {
+        ok = render_pread(&plugin, in_fd, out_fd, n, &opts);
+    } else if (!strcmp(opts.backend, "mmap")) {
+        ok = render_mmap(&plugin, in_fd, out_fd, n, &opts);
+    } else {
+        ok = render_uring(&plugin, in_fd, out_fd, n, &opts);
+    }
+    ok = ok && fdatasync(out_fd) == 0;
+
+    const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    fprintf(stderr, "render: %s: %zu samples in %.3f s, %.1f MB/s, %.1fx real time\n",
+            opts.backend, n, seconds, n * sizeof(float) / seconds / 1e6, n / opts.rate / seconds);
+
+    plugin_close(&plugin);
+    close(in_fd);
+    close(out_fd);
+    return ok ? 0 : 1;
+}
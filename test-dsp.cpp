@@ -0,0 +1,515 @@
+/**
+   Checks of the header-only DSP and IPC code, and of the render tile cache.
+
+   A failed check prints what it got and what it expected, and the program
+   exits with status 1 if any did, so `make check` fails.  The tile cache
+   check runs `./render` with the plugin and amp.jl in this directory, so it
+   needs the full build.
+*/
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "lv2/atom/atom.h"
+#include "lv2/urid/urid.h"
+
+#include "amp-compressor.hpp"
+#include "amp-kernels.hpp"
+#include "amp-limiter.hpp"
+#include "amp-scope.hpp"
+#include "amp-table.hpp"
+#include "amp-watchdog.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                               \
+    do {                                                               \
+        if (!(cond)) {                                                 \
+            fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__);                              \
+            fprintf(stderr, "\n");                                     \
+            ++failures;                                                \
+        }                                                              \
+    } while (0)
+
+/* Compressor */
+
+static void
+test_compressor_curve()
+{
+    Compressor comp;
+    memset(&comp, 0, sizeof(comp));
+    compressor_set(&comp, -20.0f, 4.0f, 6.0f, 1.0f, 100.0f, 48000.0);
+
+    // Seven levels, so both the vector loop and the scalar tail are covered
+    const float slope    = 1.0f / 4.0f - 1.0f;
+    const float level[7] = {-23.0f, -20.0f, -17.0f, -10.0f, -40.0f, -23.0f, -17.0f};
+    const float want[7]  = {0.0f, slope * 6.0f / 8.0f, slope * 6.0f / 2.0f, slope * 10.0f, 0.0f,
+                           0.0f, slope * 6.0f / 2.0f};
+    float       target[7];
+    compressor_curve(&comp, target, level, 7);
+    for (int i = 0; i < 7; ++i) {
+        CHECK(fabsf(target[i] - want[i]) < 1e-5f, "level %g: %g dB, want %g", level[i], target[i],
+              want[i]);
+    }
+
+    // A hard knee is the same curve without the quadratic part
+    compressor_set(&comp, -20.0f, 4.0f, 0.0f, 1.0f, 100.0f, 48000.0);
+    compressor_curve(&comp, target, level, 7);
+    CHECK(fabsf(target[0]) < 1e-5f && fabsf(target[3] - slope * 10.0f) < 1e-5f,
+          "hard knee: %g and %g dB", target[0], target[3]);
+}
+
+static void
+test_compressor_math()
+{
+    // log2 is documented to 1e-7 on the mantissa, plus rounding of the sum
+    double worst_log = 0.0;
+    for (int e = -126; e < 128; ++e) {
+        for (int k = 0; k < 64; ++k) {
+            const float  x   = ldexpf(1.0f + k / 64.0f + 1.0f / 256.0f, e);
+            const v4f    v   = {x, x, x, x};
+            const double l   = log2((double)x);
+            const double err = fabs(v4f_log2(v)[0] - l) - fabs(l) * FLT_EPSILON;
+            worst_log        = std::max(worst_log, err);
+        }
+    }
+    CHECK(worst_log < 2e-7, "v4f_log2 error %g", worst_log);
+
+    // exp2 is documented to 1e-6 relative over [-126, 126]
+    double worst_exp = 0.0;
+    for (int i = -126 * 64; i <= 126 * 64; ++i) {
+        const float  x   = i / 64.0f + 1.0f / 512.0f;
+        const v4f    v   = {x, x, x, x};
+        const double e   = exp2((double)std::min(x, 126.0f));
+        const double err = fabs(v4f_exp2(v)[0] - e) / e;
+        worst_exp        = std::max(worst_exp, err);
+    }
+    CHECK(worst_exp < 1e-6, "v4f_exp2 relative error %g", worst_exp);
+
+    // Silence and non-finite input get the floor, in both loops
+    const float x[5] = {0.0f, NAN, INFINITY, 1.0f, 0.0f};
+    float       level[5];
+    compressor_level(level, x, 5);
+    CHECK(level[0] == COMPRESSOR_FLOOR_DB && level[1] == COMPRESSOR_FLOOR_DB &&
+              level[2] == COMPRESSOR_FLOOR_DB && level[4] == COMPRESSOR_FLOOR_DB,
+          "floor: %g %g %g %g", level[0], level[1], level[2], level[4]);
+    CHECK(fabsf(level[3]) < 1e-5f, "level of 1: %g dB", level[3]);
+}
+
+/* Limiter */
+
+static void
+test_limiter()
+{
+    const uint32_t window  = 48;
+    const float    ceiling = 0.5f;
+    Limiter        lim;
+    CHECK(limiter_init(&lim, 480), "cannot allocate");
+    limiter_reset(&lim, window, ceiling, 0.999f);
+    CHECK(limiter_latency(&lim) == window - 1, "latency %u", limiter_latency(&lim));
+
+    // Quiet input passes unchanged, delayed by the latency
+    const uint32_t     n = 1000;
+    std::vector<float> in(n), out(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        in[i] = 0.4f * sinf(0.05f * i);
+    }
+    limiter_process(&lim, out.data(), in.data(), n);
+    float worst = 0.0f;
+    for (uint32_t i = 0; i < n; ++i) {
+        const float want = i < window - 1 ? 0.0f : in[i - (window - 1)];
+        worst            = std::max(worst, fabsf(out[i] - want));
+    }
+    CHECK(worst < 1e-6f, "quiet input off by %g", worst);
+
+    // Loud input with spikes never exceeds the ceiling, in uneven chunks
+    limiter_reset(&lim, window, ceiling, 0.999f);
+    const uint32_t     loud = 20000;
+    std::vector<float> x(loud), y(loud);
+    for (uint32_t i = 0; i < loud; ++i) {
+        x[i] = 2.0f * sinf(0.01f * i) * (i % 997 == 0 ? 4.0f : 1.0f);
+    }
+    for (uint32_t pos = 0, chunk = 1; pos < loud; pos += chunk, chunk = chunk * 7 % 509 + 1) {
+        limiter_process(&lim, y.data() + pos, x.data() + pos, std::min(chunk, loud - pos));
+    }
+    float peak = 0.0f;
+    for (uint32_t i = 0; i < loud; ++i) {
+        peak = std::max(peak, fabsf(y[i]));
+    }
+    CHECK(peak <= ceiling * (1.0f + 1e-6f), "peak %g over the ceiling %g", peak, ceiling);
+
+    // The dry line has the same latency
+    limiter_reset(&lim, window, ceiling, 0.999f);
+    limiter_dry(&lim, out.data(), in.data(), n);
+    worst = 0.0f;
+    for (uint32_t i = 0; i < n; ++i) {
+        const float want = i < window - 1 ? 0.0f : in[i - (window - 1)];
+        worst            = std::max(worst, fabsf(out[i] - want));
+    }
+    CHECK(worst == 0.0f, "dry line off by %g", worst);
+
+    limiter_free(&lim);
+}
+
+/* Watchdog */
+
+/** Feeds blocks of load `load` until the watchdog asks for a step, returns the count. */
+static uint32_t
+watchdog_blocks(Watchdog* wd, float load, int* step, uint32_t limit)
+{
+    for (uint32_t i = 1; i <= limit; ++i) {
+        if ((*step = watchdog_update(wd, load, 1.0))) {
+            return i;
+        }
+    }
+    *step = 0;
+    return limit;
+}
+
+static void
+test_watchdog()
+{
+    Watchdog wd;
+    int      step;
+    watchdog_reset(&wd, 0.5f);
+
+    // Overload steps down at the first check, once the history is full
+    uint32_t blocks = watchdog_blocks(&wd, 0.9f, &step, 1000);
+    CHECK(step == -1 && blocks == WATCHDOG_HISTORY, "step %d after %u blocks", step, blocks);
+    watchdog_stepped(&wd, step);
+    CHECK(wd.patience == 2 * WATCHDOG_PATIENCE, "patience %u", wd.patience);
+
+    // Headroom steps up only after `patience` healthy checks in a row
+    blocks = watchdog_blocks(&wd, 0.1f, &step, 10000);
+    CHECK(step == 1 && blocks == WATCHDOG_HISTORY + (wd.patience - 1) * WATCHDOG_CHECK,
+          "step %d after %u blocks", step, blocks);
+    watchdog_stepped(&wd, step);
+    CHECK(wd.patience == 2 * WATCHDOG_PATIENCE, "stepping up changed the patience to %u",
+          wd.patience);
+
+    // A load between the headroom and the budget neither steps nor counts
+    blocks = watchdog_blocks(&wd, 0.4f, &step, 2000);
+    CHECK(step == 0 && wd.healthy == 0, "step %d, %u healthy checks", step, wd.healthy);
+
+    // The p99 is the second worst block: one outlier is tolerated, two are not
+    watchdog_reset(&wd, 0.5f);
+    for (uint32_t i = 0; i < WATCHDOG_HISTORY - 1; ++i) {
+        watchdog_update(&wd, i == 10 ? 0.9 : 0.4, 1.0);
+    }
+    CHECK(watchdog_update(&wd, 0.4, 1.0) == 0, "one outlier stepped down");
+    watchdog_reset(&wd, 0.5f);
+    for (uint32_t i = 0; i < WATCHDOG_HISTORY - 1; ++i) {
+        watchdog_update(&wd, i == 10 || i == 20 ? 0.9 : 0.4, 1.0);
+    }
+    CHECK(watchdog_update(&wd, 0.4, 1.0) == -1, "two outliers did not step down");
+
+    // Patience doubles with every step down, up to the maximum
+    for (int i = 0; i < 10; ++i) {
+        watchdog_stepped(&wd, -1);
+    }
+    CHECK(wd.patience == WATCHDOG_MAX_PATIENCE, "patience %u", wd.patience);
+}
+
+/* Shared tables */
+
+static bool
+build_ramp(float* values, uint32_t count, float lo, float step, void*)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        values[i] = lo + i * step;
+    }
+    return true;
+}
+
+static void
+test_shared_table()
+{
+    // f(x) = x on [-1, 1], sampled every 0.5
+    const float values[5] = {-1.0f, -0.5f, 0.0f, 0.5f, 1.0f};
+    SharedTable table;
+    memset(&table, 0, sizeof(table));
+    table.values   = values;
+    table.count    = 5;
+    table.lo       = -1.0f;
+    table.inv_step = 2.0f;
+
+    CHECK(shared_table_lookup(&table, 0.25f) == 0.25f, "interpolated %g",
+          shared_table_lookup(&table, 0.25f));
+    CHECK(shared_table_lookup(&table, -7.0f) == -1.0f, "below %g", shared_table_lookup(&table, -7.0f));
+    CHECK(shared_table_lookup(&table, 7.0f) == 1.0f, "above %g", shared_table_lookup(&table, 7.0f));
+    CHECK(shared_table_lookup(&table, 1.0f) == 1.0f, "last %g", shared_table_lookup(&table, 1.0f));
+    CHECK(shared_table_lookup(&table, NAN) == -1.0f, "NaN %g", shared_table_lookup(&table, NAN));
+    CHECK(shared_table_lookup(&table, INFINITY) == 1.0f, "Inf %g",
+          shared_table_lookup(&table, INFINITY));
+    CHECK(shared_table_lookup(&table, -INFINITY) == -1.0f, "-Inf %g",
+          shared_table_lookup(&table, -INFINITY));
+
+    float       out[3];
+    const float x[3] = {-0.5f, 0.0f, 0.5f};
+    shared_table_lookup_block(&table, out, 0.25f, x, 3);
+    CHECK(out[0] == -0.25f && out[1] == 0.25f && out[2] == 0.75f, "block %g %g %g", out[0], out[1],
+          out[2]);
+
+    // The first open builds and shares the table, the second maps it
+    const uint64_t key = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+    SharedTable    built, mapped;
+    const bool     ok1 = shared_table_open(&built, "test", key, 101, -5.0f, 0.1f, build_ramp, NULL);
+    const bool     ok2 = shared_table_open(&mapped, "test", key, 101, -5.0f, 0.1f, build_ramp, NULL);
+    CHECK(ok1 && built.built, "not built");
+    CHECK(ok2 && mapped.shared && !mapped.built, "not mapped from the first");
+    CHECK(ok1 && ok2 && fabsf(shared_table_lookup(&mapped, 2.55f) - 2.55f) < 1e-5f, "mapped %g",
+          shared_table_lookup(&mapped, 2.55f));
+    shared_table_close(&built);
+    shared_table_close(&mapped);
+
+    // Same name as shared_table_open()
+    uint64_t name_key = key;
+    uint32_t count    = 101;
+    float    lo       = -5.0f;
+    float    step     = 0.1f;
+    name_key          = fnv1a(name_key, &count, sizeof(count));
+    name_key          = fnv1a(name_key, &lo, sizeof(lo));
+    name_key          = fnv1a(name_key, &step, sizeof(step));
+    char name[128];
+    snprintf(name, sizeof(name), "/julia-amp-%u-test-%016llx", (unsigned)geteuid(),
+             (unsigned long long)name_key);
+    shm_unlink(name);
+}
+
+/* Scope */
+
+static LV2_URID
+map_uri(LV2_URID_Map_Handle handle, const char* uri)
+{
+    std::vector<std::string>* uris = (std::vector<std::string>*)handle;
+    for (size_t i = 0; i < uris->size(); ++i) {
+        if ((*uris)[i] == uri) {
+            return (LV2_URID)(i + 1);
+        }
+    }
+    uris->push_back(uri);
+    return (LV2_URID)uris->size();
+}
+
+/** Writes into a notify buffer of `capacity` bytes, returns the summaries in it. */
+static uint32_t
+scope_written(Scope* scope, uint32_t capacity, std::vector<float>* floats)
+{
+    std::vector<uint64_t> buf(capacity / 8 + 8, 0xDEADBEEFDEADBEEFull);  // Aligned, with a guard
+    LV2_Atom_Sequence*    seq = (LV2_Atom_Sequence*)buf.data();
+    seq->atom.size            = capacity - sizeof(LV2_Atom);
+    scope_write(scope, seq);
+
+    CHECK(sizeof(LV2_Atom) + seq->atom.size <= capacity, "%u bytes written into %u",
+          (unsigned)(sizeof(LV2_Atom) + seq->atom.size), capacity);
+    CHECK(seq->atom.type == scope->uris.atom_Sequence, "type %u", seq->atom.type);
+    const uint8_t* end = (const uint8_t*)buf.data() + capacity;
+    for (const uint8_t* p = end; p < (const uint8_t*)(buf.data() + buf.size()); ++p) {
+        if (*p != 0xEF && *p != 0xBE && *p != 0xAD && *p != 0xDE) {
+            CHECK(false, "wrote past the capacity of %u", capacity);
+            break;
+        }
+    }
+    if (seq->atom.size == sizeof(LV2_Atom_Sequence_Body)) {
+        return 0;
+    }
+
+    const LV2_Atom_Event* ev = (const LV2_Atom_Event*)(seq + 1);
+    CHECK(seq->atom.size == sizeof(LV2_Atom_Sequence_Body) + sizeof(LV2_Atom_Event) +
+                                lv2_atom_pad_size(ev->body.size),
+          "sequence of %u bytes around an event of %u", seq->atom.size, ev->body.size);
+    CHECK(ev->body.type == scope->uris.atom_Object, "event type %u", ev->body.type);
+
+    // Walk the properties as a host would
+    const LV2_Atom_Object_Body* obj     = (const LV2_Atom_Object_Body*)(ev + 1);
+    const uint8_t*              p       = (const uint8_t*)(obj + 1);
+    const uint8_t*              obj_end = (const uint8_t*)obj + ev->body.size;
+    uint32_t                    count   = 0;
+    while (p < obj_end) {
+        const LV2_Atom_Property_Body* prop = (const LV2_Atom_Property_Body*)p;
+        if (prop->key == scope->uris.summaries) {
+            const LV2_Atom_Vector_Body* vec = (const LV2_Atom_Vector_Body*)(prop + 1);
+            CHECK(vec->child_size == sizeof(float) && vec->child_type == scope->uris.atom_Float,
+                  "vector of %u-byte %u", vec->child_size, vec->child_type);
+            const uint32_t n = (prop->value.size - sizeof(LV2_Atom_Vector_Body)) / sizeof(float);
+            CHECK(n % 3 == 0, "%u floats", n);
+            floats->insert(floats->end(), (const float*)(vec + 1), (const float*)(vec + 1) + n);
+            count = n / 3;
+        }
+        p += sizeof(LV2_Atom_Property_Body) + lv2_atom_pad_size(prop->value.size);
+    }
+    CHECK(p == obj_end, "properties overrun the object by %d bytes", (int)(p - obj_end));
+    return count;
+}
+
+static void
+test_scope()
+{
+    std::vector<std::string> uris;
+    LV2_URID_Map             map = {&uris, map_uri};
+    Scope                    scope{};
+    CHECK(scope_init(&scope, 16, &map, "urn:test"), "cannot allocate");
+
+    // Four windows: a ramp, silence, a constant and a square
+    float x[64];
+    for (int i = 0; i < 64; ++i) {
+        x[i] = i < 16 ? i / 16.0f : i < 32 ? 0.0f : i < 48 ? -0.5f : (i % 2 ? 1.0f : -1.0f);
+    }
+    scope_feed(&scope, x, 10);  // Windows run across calls
+    scope_feed(&scope, x + 10, 54);
+
+    // Too small for one summary: an empty sequence, everything stays queued
+    std::vector<float> floats;
+    CHECK(scope_written(&scope, 64, &floats) == 0, "summaries in 64 bytes");
+    CHECK(scope.head.load() - scope.tail.load() == 4, "%u queued",
+          scope.head.load() - scope.tail.load());
+
+    // Room for one, then for the rest
+    const uint32_t fixed = sizeof(LV2_Atom) + sizeof(LV2_Atom_Sequence_Body) +
+                           sizeof(LV2_Atom_Event) + sizeof(LV2_Atom_Object_Body) +
+                           2 * (sizeof(LV2_Atom_Property_Body) + 8) +
+                           sizeof(LV2_Atom_Property_Body) + sizeof(LV2_Atom_Vector_Body);
+    CHECK(scope_written(&scope, fixed + 16, &floats) == 1, "not one summary in %u bytes",
+          fixed + 16);
+    CHECK(scope_written(&scope, 4096, &floats) == 3, "not the other three");
+    CHECK(scope_written(&scope, 4096, &floats) == 0, "summaries written twice");
+
+    const float want[12] = {0.0f,  15.0f / 16.0f, sqrtf(1240.0f / 256.0f / 16.0f),
+                            0.0f,  0.0f,          0.0f,
+                            -0.5f, -0.5f,         0.5f,
+                            -1.0f, 1.0f,          1.0f};
+    CHECK(floats.size() == 12, "%u floats", (unsigned)floats.size());
+    for (size_t i = 0; i < floats.size() && i < 12; ++i) {
+        CHECK(fabsf(floats[i] - want[i]) < 1e-6f, "summary value %u: %g, want %g", (unsigned)i,
+              floats[i], want[i]);
+    }
+
+    scope_free(&scope);
+}
+
+/* Render tile cache */
+
+/** Runs `command`, returns how many tiles it reused, or -1 if it failed. */
+static int
+render(const std::string& command)
+{
+    FILE* out = popen((command + " 2>&1").c_str(), "r");
+    if (!out) {
+        return -1;
+    }
+    char line[512];
+    int  reused = 0, tiles;
+    while (fgets(line, sizeof(line), out)) {
+        sscanf(line, "render: %d of %d tiles from the cache", &reused, &tiles);
+    }
+    return pclose(out) ? -1 : reused;
+}
+
+static bool
+read_floats(const std::string& path, std::vector<float>* data)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    float x;
+    data->clear();
+    while (fread(&x, sizeof(x), 1, file) == 1) {
+        data->push_back(x);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool
+write_floats(const std::string& path, const std::vector<float>& data)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    const bool ok = fwrite(data.data(), sizeof(float), data.size(), file) == data.size();
+    return !fclose(file) && ok;
+}
+
+/** Whether `a` and `b` are the same render. */
+static bool
+same_floats(const std::string& a, const std::string& b)
+{
+    std::vector<float> x, y;
+    if (!read_floats(a, &x) || !read_floats(b, &y) || x.size() != y.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < x.size(); ++i) {
+        if (fabsf(x[i] - y[i]) > 1e-6f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+test_render_cache()
+{
+    char dir[] = "/tmp/julia-amp-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        CHECK(false, "cannot create a directory");
+        return;
+    }
+    const std::string d     = dir;
+    const std::string plain = "./render -B . -g -6 -i pread -t 4096 ";
+    const std::string cache = "./render -B . -g -6 -t 4096 -m 20 -c " + d + "/cache ";
+
+    // Four tiles of a tone
+    std::vector<float> in(4 * 4096);
+    for (size_t i = 0; i < in.size(); ++i) {
+        in[i] = 0.5f * sinf(0.01f * i);
+    }
+    CHECK(write_floats(d + "/in", in), "cannot write the input");
+
+    CHECK(render(plain + d + "/in " + d + "/ref") >= 0, "plain render failed");
+    int reused = render(cache + d + "/in " + d + "/cold");
+    CHECK(reused == 0 && same_floats(d + "/ref", d + "/cold"), "cold cache: %d reused", reused);
+    reused = render(cache + d + "/in " + d + "/warm");
+    CHECK(reused == 4 && same_floats(d + "/ref", d + "/warm"), "warm cache: %d reused", reused);
+
+    // A change early in the third tile, outside the next tile's memory, only
+    // renders that tile again
+    in[2 * 4096 + 100] = 0.0f;
+    CHECK(write_floats(d + "/in", in), "cannot write the input");
+    CHECK(render(plain + d + "/in " + d + "/ref") >= 0, "plain render failed");
+    reused = render(cache + d + "/in " + d + "/edit");
+    CHECK(reused == 3 && same_floats(d + "/ref", d + "/edit"), "edited input: %d reused", reused);
+
+    CHECK(system(("rm -rf " + d).c_str()) == 0, "cannot remove %s", dir);
+}
+
+int
+main()
+{
+    test_compressor_curve();
+    test_compressor_math();
+    test_limiter();
+    test_watchdog();
+    test_shared_table();
+    test_scope();
+    test_render_cache();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+    } else {
+        printf("All checks passed\n");
+    }
+    return failures ? 1 : 0;
+}
@@ -72,7 +72,7 @@ int main() {
   pthread_t thread_id;
   const double rate = 48000;
   const LV2_Feature ** features = NULL;
-  const char* bundle_path = "path";
+  const char* bundle_path = ".";
 
   const char* uri;
   LV2_Handle instance;